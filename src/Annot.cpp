@@ -31,14 +31,416 @@
 #include <unistd.h>
 #include <time.h> 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "Obj.h"
 #include "PDFFile.h"
 #include "Stream.h"
 #include "Annot.h"
+#include "MD5.h"
+#include "SHA256.h"
 
 
 extern int      verbose;
+extern int      sha256;
+
+// Size of the pieces of a mapped file given to the compressor.
+#define ATT_PIECE       (1024 * 1024)
+
+// Attachments with at least this many pieces are compressed on several
+// threads.
+#define ATT_PARALLEL    4
+
+// Piece of a large attachment compressed on its own. Each is raw deflate
+// primed with the end of the piece before, and all but the last end on
+// a byte boundary, so they join into one stream.
+struct zblock {
+    const char      *in;
+    unsigned int    len;
+    int             last;
+    char            *out;
+    unsigned int    olen;
+    uLong           adler;          // Adler-32 of in.
+    int             done;
+    struct zblock   *next;
+};
+
+struct zpool {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;           // A block was finished or written.
+    const char      *data;
+    off_t           size;
+    off_t           pos;            // Start of the next block to make.
+    int             seq;            // Blocks handed out.
+    int             written;        // Blocks put in the file.
+    int             ahead;          // Blocks allowed past written.
+    struct zblock   *first;         // Blocks not yet written, in order.
+    struct zblock   **last;
+};
+
+static void
+zblock_deflate(struct zblock *b, const char *data)
+{
+    z_stream        zs;
+    uLong           bound;
+
+    memset(&zs, 0, sizeof(z_stream));
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.data_type = Z_BINARY;
+    deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8,
+                 Z_DEFAULT_STRATEGY);
+    if (b->in != data)
+        deflateSetDictionary(&zs, (Bytef *)b->in - 32768, 32768);
+    // Room for the flush marker as well.
+    bound = deflateBound(&zs, b->len) + 16;
+    b->out = new char[bound];
+    zs.next_in = (Bytef *)b->in;
+    zs.avail_in = b->len;
+    zs.next_out = (Bytef *)b->out;
+    zs.avail_out = bound;
+    deflate(&zs, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+    b->olen = zs.total_out;
+    deflateEnd(&zs);
+    b->adler = adler32(adler32(0L, Z_NULL, 0), (Bytef *)b->in, b->len);
+}
+
+// Cut the next block off the data, with the lock held. 0 at the end.
+static struct zblock *
+zblock_take(struct zpool *zp)
+{
+    struct zblock   *b;
+
+    if (zp->pos >= zp->size)
+        return 0;
+    b = new struct zblock;
+    b->in = &zp->data[zp->pos];
+    b->len = ATT_PIECE;
+    if (b->len > zp->size - zp->pos)
+        b->len = zp->size - zp->pos;
+    zp->pos += b->len;
+    b->last = zp->pos == zp->size;
+    b->done = 0;
+    b->next = 0;
+    *zp->last = b;
+    zp->last = &b->next;
+    zp->seq++;
+    return b;
+}
+
+static void *
+zblock_run(void *arg)
+{
+    struct zpool    *zp = (struct zpool *)arg;
+    struct zblock   *b;
+
+    for (;;) {
+        pthread_mutex_lock(&zp->lock);
+        while (zp->pos < zp->size && zp->seq >= zp->written + zp->ahead)
+            pthread_cond_wait(&zp->cond, &zp->lock);
+        b = zblock_take(zp);
+        pthread_mutex_unlock(&zp->lock);
+        if (b == 0)
+            break;
+        zblock_deflate(b, zp->data);
+        pthread_mutex_lock(&zp->lock);
+        b->done = 1;
+        pthread_cond_broadcast(&zp->cond);
+        pthread_mutex_unlock(&zp->lock);
+    }
+    return NULL;
+}
+
+// Compress a mapped file into the stream on n threads, writing the
+// blocks in order as they are done. The data is added to hash and sha,
+// if given, as it is written.
+static void
+deflate_blocks(Stream *fs, const char *data, off_t size, int n, MD5 *hash,
+               SHA256 *sha)
+{
+    struct zpool    zp;
+    struct zblock   *b;
+    pthread_t       *tid;
+    uLong           adler = adler32(0L, Z_NULL, 0);
+    unsigned char   hdr[4];
+    int             k;
+
+    pthread_mutex_init(&zp.lock, NULL);
+    pthread_cond_init(&zp.cond, NULL);
+    zp.data = data;
+    zp.size = size;
+    zp.pos = 0;
+    zp.seq = 0;
+    zp.written = 0;
+    zp.ahead = 2 * n;
+    zp.first = 0;
+    zp.last = &zp.first;
+    tid = new pthread_t[n];
+    for (k = 0; k < n; k++) {
+        if (pthread_create(&tid[k], NULL, zblock_run, &zp) != 0)
+            break;
+    }
+    n = k;
+    fs->putOpen("/Filter/FlateDecode");
+    hdr[0] = 0x78;
+    hdr[1] = 0xda;
+    fs->putData((char *)hdr, 2);
+    for (;;) {
+        // Make the next block here if no thread has got to it.
+        pthread_mutex_lock(&zp.lock);
+        if (zp.first == 0) {
+            b = zblock_take(&zp);
+            if (b == 0) {
+                pthread_mutex_unlock(&zp.lock);
+                break;
+            }
+            pthread_mutex_unlock(&zp.lock);
+            zblock_deflate(b, data);
+            pthread_mutex_lock(&zp.lock);
+            b->done = 1;
+        }
+        b = zp.first;
+        while (!b->done)
+            pthread_cond_wait(&zp.cond, &zp.lock);
+        zp.first = b->next;
+        if (zp.first == 0)
+            zp.last = &zp.first;
+        pthread_mutex_unlock(&zp.lock);
+        fs->putData(b->out, b->olen);
+        fs->size += b->len;
+        if (hash)
+            hash->update(b->in, b->len);
+        if (sha)
+            sha->update(b->in, b->len);
+        adler = adler32_combine(adler, b->adler, b->len);
+        // Once compressed it is not needed again, other than the end as
+        // the dictionary of the next block which will be read back in.
+        madvise((void *)b->in, b->len, MADV_DONTNEED);
+        delete[] b->out;
+        delete b;
+        pthread_mutex_lock(&zp.lock);
+        zp.written++;
+        pthread_cond_broadcast(&zp.cond);
+        pthread_mutex_unlock(&zp.lock);
+    }
+    for (k = 0; k < n; k++)
+        pthread_join(tid[k], NULL);
+    delete[] tid;
+    pthread_mutex_destroy(&zp.lock);
+    pthread_cond_destroy(&zp.cond);
+    hdr[0] = adler >> 24;
+    hdr[1] = adler >> 16;
+    hdr[2] = adler >> 8;
+    hdr[3] = adler;
+    fs->putData((char *)hdr, 4);
+    fs->putClose();
+}
+
+// Deflate data already in a file, which can be copied into a stream as it
+// is rather than inflated and compressed again.
+struct zsource {
+    off_t           start;          // Where the deflate data starts.
+    off_t           len;            // Length of it.
+    int             gzip;           // Raw deflate from a gzip file, which
+                                    // needs a zlib header and adler32.
+    uLong           adler;          // Adler32 of the inflated data.
+    off_t           size;           // Size of the inflated data.
+};
+
+// Find the deflate data in a mapped gzip or zlib file. It is inflated
+// once, without keeping the output, to make sure it is whole, to get
+// the adler32 that a gzip file does not have, and to add the data to
+// md5 and sha. Files with more than one gzip member, or anything else
+// after the data, are not taken.
+static int
+deflated(const char *data, off_t size, struct zsource *zsrc, MD5 *md5,
+         SHA256 *sha)
+{
+    const unsigned char *d = (const unsigned char *)data;
+    z_stream        strm;
+    char            *out;
+    uLong           crc = crc32(0L, Z_NULL, 0);
+    off_t           p, done;
+    unsigned int    len, got;
+    int             r;
+    int             ok;
+
+    zsrc->adler = adler32(0L, Z_NULL, 0);
+    if (size >= 18 && d[0] == 0x1f && d[1] == 0x8b && d[2] == 8) {
+        if (d[3] & 0xe0)
+            return 0;
+        p = 10;
+        if (d[3] & 4)                   // FEXTRA
+            p += 2 + (d[p] | (d[p+1] << 8));
+        if (d[3] & 8) {                 // FNAME
+            while (p < size && d[p] != 0)
+                p++;
+            p++;
+        }
+        if (d[3] & 16) {                // FCOMMENT
+            while (p < size && d[p] != 0)
+                p++;
+            p++;
+        }
+        if (d[3] & 2)                   // FHCRC
+            p += 2;
+        if (p > size - 10)
+            return 0;
+        zsrc->gzip = 1;
+    } else if (size >= 6 && (d[0] & 0x0f) == 8 && (d[0] >> 4) <= 7 &&
+               (d[1] & 0x20) == 0 && ((d[0] << 8) | d[1]) % 31 == 0) {
+        p = 0;
+        zsrc->gzip = 0;
+    } else {
+        return 0;
+    }
+
+    memset(&strm, 0, sizeof(z_stream));
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    if (inflateInit2(&strm, zsrc->gzip ? -15 : 15) != Z_OK)
+        return 0;
+    out = new char[ZBUF_SIZE];
+    r = Z_OK;
+    for (done = p; r == Z_OK && done < size; done += len) {
+        len = ATT_PIECE;
+        if (len > size - done)
+            len = size - done;
+        strm.next_in = (Bytef *)&data[done];
+        strm.avail_in = len;
+        do {
+            strm.next_out = (Bytef *)out;
+            strm.avail_out = ZBUF_SIZE;
+            r = inflate(&strm, Z_NO_FLUSH);
+            if (r != Z_OK && r != Z_STREAM_END)
+                break;
+            got = ZBUF_SIZE - strm.avail_out;
+            if (zsrc->gzip) {
+                zsrc->adler = adler32(zsrc->adler, (Bytef *)out, got);
+                crc = crc32(crc, (Bytef *)out, got);
+            }
+            md5->update(out, got);
+            if (sha)
+                sha->update(out, got);
+        } while (r == Z_OK && strm.avail_out == 0);
+        if (r == Z_BUF_ERROR && strm.avail_in == 0)
+            r = Z_OK;
+    }
+    delete[] out;
+    zsrc->start = p;
+    zsrc->len = strm.total_in;
+    zsrc->size = strm.total_out;
+    inflateEnd(&strm);
+    if (r != Z_STREAM_END) {
+        ok = 0;
+    } else if (!zsrc->gzip) {
+        ok = (zsrc->len == size);
+    } else {
+        // The gzip trailer is the crc32 and size of the data.
+        p += zsrc->len;
+        ok = p + 8 == size &&
+             (d[p] | (d[p+1] << 8) | (d[p+2] << 16) |
+                   ((uLong)d[p+3] << 24)) == crc &&
+             (d[p+4] | (d[p+5] << 8) | (d[p+6] << 16) |
+                   ((uLong)d[p+7] << 24)) == (zsrc->size & 0xffffffffUL);
+    }
+    // The file is compressed again, so the sums start over.
+    if (!ok) {
+        md5->reset();
+        if (sha)
+            sha->reset();
+    }
+    return ok;
+}
+
+// Copy n bytes of text to out, making each LF that does not follow a CR
+// into CR LF, so out needs room for 2 * n. last holds the byte before
+// the text, and is left with the last byte of it. Returns the size of
+// the text once copied.
+static unsigned long
+crlf(const char *in, unsigned long n, char *last, char *out)
+{
+    const char      *start = out;
+    const char      *end = in + n;
+    int             cr = (*last == '\r');
+#ifdef __SSE2__
+    __m128i         nl = _mm_set1_epi8('\n');
+    __m128i         ret = _mm_set1_epi8('\r');
+    __m128i         v;
+    unsigned int    lf, crs, bare;
+    int             k;
+
+    for (; end - in >= 16; in += 16) {
+        v = _mm_loadu_si128((const __m128i *)in);
+        lf = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        crs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, ret));
+        bare = lf & ~((crs << 1) | cr);
+        cr = crs >> 15;
+        if (bare == 0) {
+            _mm_storeu_si128((__m128i *)out, v);
+            out += 16;
+            continue;
+        }
+        for (k = 0; k < 16; k++) {
+            if (bare & (1 << k))
+                *out++ = '\r';
+            *out++ = in[k];
+        }
+    }
+#endif
+    for (; in < end; in++) {
+        if (*in == '\n' && !cr)
+            *out++ = '\r';
+        cr = (*in == '\r');
+        *out++ = *in;
+    }
+    if (n != 0)
+        *last = end[-1];
+    return out - start;
+}
+
+// The end put on text whose last line has no LF.
+static const char *
+crlf_end(char last)
+{
+    if (last == '\n')
+        return "";
+    if (last == '\r')
+        return "\n";
+    return "\r\n";
+}
+
+// Put the Params of an embedded file. This comes after the data, once
+// the checksums of it are known. sha is 0 unless asked for.
+static void
+put_params(Obj *p, unsigned long size, time_t mtime,
+           const unsigned char *md5, const unsigned char *sha)
+{
+    char    buffer[80];
+    int     i;
+
+    p->open();
+    p->put("Size", (int)size);
+    p->put("CreationDate", mtime);
+    p->put("/CheckSum <");
+    for (i = 0; i < 16; i++)
+        sprintf(&buffer[i*2], "%02x", md5[i]);
+    p->put(buffer);
+    p->put('>');
+    if (sha) {
+        p->put("/SHA256 <");
+        for (i = 0; i < 32; i++)
+            sprintf(&buffer[i*2], "%02x", sha[i]);
+        p->put(buffer);
+        p->put('>');
+    }
+    p->close();
+}
 
 //
 // Load a file into the generated PDF file.
@@ -53,9 +455,29 @@ Annot::load(PDFfile *file, const char *name, const char *ftype, int mode)
 {
     FILE    *f;
     char    buffer[1024];
+    char    *data = 0;
+    off_t   done;
+    off_t   off;
+    long    page;
     int     len;
+    int     n;
     Stream  *fs;
+    Obj     *ef = 0;
+    MD5     md5, *hash = &md5;
+    MD5     check;                  // Of the data as it is extracted.
+    SHA256  sha_sum, *sha = sha256 ? &sha_sum : 0;
+    Obj     *params;
+    unsigned char sum[16];
+    unsigned char csum[16];
+    unsigned char ssum[32];
+    unsigned char hdr[4];
     struct stat st;
+    struct zsource zsrc;
+    int     gunzip = 0;
+    char    *fname;
+    char    *text;
+    char    last;
+    unsigned long size;
 
     f = fopen(name, "r");
     if (!f) {
@@ -66,50 +488,227 @@ Annot::load(PDFfile *file, const char *name, const char *ftype, int mode)
     if (verbose) 
         fprintf(stderr, "Including file %s (%s) ", name, ftype);
 
-    // Create a sub stream.
-    fs = file->newStream();
-    fs->open("EmbeddedFile");
-
-    // Set mode.
-    if(mode) 
-       fs->put("/Subtype/Application#2Foctet-stream"); 
-    else 
-       fs->put("/Subtype/Text#2Fplain#20charset=us-ascii");
-    // Slurp file in in chunks
-    if (mode) {
-        while((len = fread(buffer, 1, sizeof(buffer), f)) > 0) 
-            fs->appendData(buffer, len);
-    } else { 
-        while(fgets(buffer, sizeof(buffer), f) != NULL) {
-            char    *p = &buffer[strlen(buffer)-1];
-            if (*p == '\n')
-                p--;
-            if (*p != '\r')
-                *++p = '\r';
-            *++p = '\n';
-            *++p = '\0';
-            fs->appendCmd(buffer);
+    if (fstat(fileno(f), &st) != 0)
+        st.st_mode = 0;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = (char *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE,
+                            fileno(f), 0);
+        if (data == (char *)MAP_FAILED)
+            data = 0;
+        else
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    // A file the same size as one already included is hashed first, and
+    // if it is the same that one is used again.
+    if (S_ISREG(st.st_mode) && file->findFile(st.st_size, mode) != 0) {
+        if (data != 0) {
+            for (done = 0; done < st.st_size; done += len) {
+                len = ATT_PIECE;
+                if (len > st.st_size - done)
+                    len = st.st_size - done;
+                md5.update(&data[done], len);
+                madvise(&data[done], len, MADV_DONTNEED);
+            }
+        } else {
+            while((len = fread(buffer, 1, sizeof(buffer), f)) > 0) 
+                md5.update(buffer, len);
+            rewind(f);
+        }
+        md5.final(sum);
+        hash = 0;
+        ef = file->findFile(st.st_size, mode, sum, &gunzip);
+        if (ef != 0 && verbose)
+            fprintf(stderr, "same as before\n");
+    }
+
+    if (ef == 0) {
+        // Create a sub stream.
+        fs = file->newStream();
+        fs->open("EmbeddedFile");
+
+        // Set mode.
+        if(mode) 
+           fs->put("/Subtype/Application#2Foctet-stream"); 
+        else 
+           fs->put("/Subtype/Text#2Fplain#20charset=us-ascii");
+        params = fs->obj->newObj();
+        params->ref("Params");
+        // Binary files that can be mapped are compressed straight from the
+        // mapping into the file, a piece at a time.
+        // Those already compressed are copied as they are.
+        if (mode && data != 0 &&
+                    deflated(data, st.st_size, &zsrc, &check, sha)) {
+            size = zsrc.size;
+            if (verbose)
+                fprintf(stderr, "%lu bytes, already compressed\n", size);
+            fs->putOpen("/Filter/FlateDecode");
+            if (zsrc.gzip) {
+                hdr[0] = 0x78;
+                hdr[1] = 0x9c;
+                fs->putData((char *)hdr, 2);
+                gunzip = 1;
+            }
+            if (hash)
+                hash->update(data, zsrc.start);
+            page = sysconf(_SC_PAGESIZE);
+            for (done = 0; done < zsrc.len; done += len) {
+                len = ATT_PIECE;
+                if (len > zsrc.len - done)
+                    len = zsrc.len - done;
+                if (hash)
+                    hash->update(&data[zsrc.start + done], len);
+                fs->putData(&data[zsrc.start + done], len);
+                // The member starts part way into a page and madvise only
+                // takes whole pages, so go back to the start of the page.
+                off = (zsrc.start + done) & (page - 1);
+                if (madvise(&data[zsrc.start + done - off], len + off,
+                            MADV_DONTNEED) != 0 && verbose)
+                    perror("madvise");
+            }
+            if (hash)
+                hash->update(&data[zsrc.start + zsrc.len],
+                             st.st_size - zsrc.start - zsrc.len);
+            if (zsrc.gzip) {
+                hdr[0] = zsrc.adler >> 24;
+                hdr[1] = zsrc.adler >> 16;
+                hdr[2] = zsrc.adler >> 8;
+                hdr[3] = zsrc.adler;
+                fs->putData((char *)hdr, 4);
+            }
+            fs->size = zsrc.size;
+            fs->putClose();
+            check.final(csum);
+        } else if (mode && data != 0) {
+            size = st.st_size;
+            if (verbose)
+                fprintf(stderr, "%lu bytes\n", size);
+            n = sysconf(_SC_NPROCESSORS_ONLN);
+            if (n > 16)
+                n = 16;
+            if (n > 1 && st.st_size >= (off_t)ATT_PARALLEL * ATT_PIECE) {
+                deflate_blocks(fs, data, st.st_size, n - 1, hash, sha);
+            } else {
+                fs->deflateOpen();
+                for (done = 0; done < st.st_size; done += len) {
+                    len = ATT_PIECE;
+                    if (len > st.st_size - done)
+                        len = st.st_size - done;
+                    if (hash)
+                        hash->update(&data[done], len);
+                    if (sha)
+                        sha->update(&data[done], len);
+                    fs->deflateData(&data[done], len);
+                    // Once compressed it is not needed again.
+                    madvise(&data[done], len, MADV_DONTNEED);
+                }
+                fs->deflateClose();
+            }
+            // What is extracted is the file, so it is the same sum.
+            if (hash)
+                md5.final(sum);
+            hash = 0;
+            memcpy(csum, sum, 16);
+        } else if (data != 0) {
+            // Text has its line ends made CR LF on the way to the
+            // compressor. Its size is added up as it goes, as /Params
+            // is put after the data.
+            fs->deflateOpen();
+            text = new char[2 * ATT_PIECE];
+            last = '\n';
+            size = 0;
+            for (done = 0; done < st.st_size; done += len) {
+                len = ATT_PIECE;
+                if (len > st.st_size - done)
+                    len = st.st_size - done;
+                if (hash)
+                    hash->update(&data[done], len);
+                n = crlf(&data[done], len, &last, text);
+                size += n;
+                check.update(text, n);
+                if (sha)
+                    sha->update(text, n);
+                fs->deflateData(text, n);
+                madvise(&data[done], len, MADV_DONTNEED);
+            }
+            n = strlen(crlf_end(last));
+            size += n;
+            check.update(crlf_end(last), n);
+            if (sha)
+                sha->update(crlf_end(last), n);
+            fs->deflateData(crlf_end(last), n);
+            fs->deflateClose();
+            delete[] text;
+            check.final(csum);
+            if (verbose)
+                fprintf(stderr, "%lu bytes\n", size);
+        } else {
+            // Slurp file in in chunks
+            if (mode) {
+                while((len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+                    if (hash)
+                        hash->update(buffer, len);
+                    check.update(buffer, len);
+                    if (sha)
+                        sha->update(buffer, len);
+                    fs->appendData(buffer, len);
+                }
+            } else { 
+                text = new char[2 * sizeof(buffer)];
+                last = '\n';
+                while((len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+                    if (hash)
+                        hash->update(buffer, len);
+                    n = crlf(buffer, len, &last, text);
+                    check.update(text, n);
+                    if (sha)
+                        sha->update(text, n);
+                    fs->appendData(text, n);
+                }
+                n = strlen(crlf_end(last));
+                check.update(crlf_end(last), n);
+                if (sha)
+                    sha->update(crlf_end(last), n);
+                fs->appendCmd(crlf_end(last));
+                delete[] text;
+            }
+            // Make sure all data is pushed to stream.
+            fs->flush();
+            size = fs->size;
+            if (verbose)
+                fprintf(stderr, "%lu bytes\n", size);
+            stat(name, &st);
+            fs->close();
+            check.final(csum);
         }
+        if (sha)
+            sha->final(ssum);
+        // Create description of object in PDF file.
+        put_params(params, size, st.st_mtime, csum, sha ? ssum : 0);
+        if (hash)
+            md5.final(sum);
+        if (S_ISREG(st.st_mode))
+            file->addFile(st.st_size, mode, sum, fs->obj, gunzip);
+        ef = fs->obj;
+        delete fs;
     }
-    // Make sure all data is pushed to stream.
-    fs->flush();
-    // Create description of object in PDF file.
-    fs->put("/Params <<");
-    fs->put("Size", (int)fs->size);
-    if (verbose)
-        fprintf(stderr, "%d bytes\n", fs->size);
-    stat(name, &st);
-    fs->put("CreationDate", st.st_mtime);
-    fs->put(">> ");
-    fs->close();
+    if (data != 0)
+        munmap(data, st.st_size);
+    fclose(f);
+    // What comes out of a gzip file is no longer gzip, so drop the .gz.
+    fname = new char[strlen(name)+1];
+    strcpy(fname, name);
+    n = strlen(fname);
+    if (gunzip && n > 3 && strcmp(&fname[n-3], ".gz") == 0)
+        fname[n-3] = '\0';
     // Append to file.
     obj->open("Filespec");
-    obj->put("F", name);
+    obj->put("F", fname);
     obj->put("/EF<<");
-    fs->ref("F");
+    ef->ref("F");
     obj->put(">> ");
     obj->close();
-    delete fs;
+    delete[] fname;
 
     if (ftype) {
         type = new char[strlen(ftype)+1];
@@ -151,46 +750,125 @@ Annot
     return a;
 }
 
+// Hash of an annotation id.
+static unsigned int
+annot_hash(const char *s)
+{
+    unsigned int    h = 2166136261u;
+
+    while (*s != '\0')
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+// Turn a chain around.
+Annot
+*Annots::reverse(Annot *a)
+{
+    Annot   *r = 0;
+    Annot   *n;
+
+    for (; a != 0; a = n) {
+        n = a->next;
+        a->next = r;
+        r = a;
+    }
+    return r;
+}
+
+//
+// Move new annotations into the table, which grows to keep the
+// chains short. They get their id after they are made, so this is
+// put off until one is looked for. Each chain runs from newest to
+// oldest, so the newest of the same id is found, as it was when
+// they were all on one list. Those that never got an id are kept
+// aside.
+void
+Annots::index()
+{
+    Annot           **nt;
+    Annot           *a, *n;
+    unsigned int    ns, i, h;
+
+    for (a = reverse(list); a != 0; a = n) {
+        n = a->next;
+        if (a->id == 0) {
+            a->next = noid;
+            noid = a;
+            continue;
+        }
+        if (count >= tsize) {
+            ns = (tsize == 0) ? 64 : tsize * 2;
+            nt = new Annot *[ns];
+            memset(nt, 0, ns * sizeof(Annot *));
+            // Oldest first, each chain only splits in two.
+            for (i = 0; i < tsize; i++) {
+                Annot   *b, *c;
+                for (b = reverse(table[i]); b != 0; b = c) {
+                    c = b->next;
+                    h = annot_hash(b->id) & (ns - 1);
+                    b->next = nt[h];
+                    nt[h] = b;
+                }
+            }
+            delete[] table;
+            table = nt;
+            tsize = ns;
+        }
+        h = annot_hash(a->id) & (tsize - 1);
+        a->next = table[h];
+        table[h] = a;
+        count++;
+    }
+    list = 0;
+}
+
 //
 // Set place where annotation will appear.
 void
 Annots::ref(char *name, int x, int y)
 {
-    Annot   *a = list;
+    Annot   *a;
 
-    while(a != 0) {
+    if (list != 0)
+        index();
+    if (tsize == 0)
+        return;
+    for (a = table[annot_hash(name) & (tsize - 1)]; a != 0; a = a->next) {
         if (strcmp(a->id, name) == 0) {
             a->x = x;
             a->y = y;
-            a->ref = 1;
+            if (!a->ref) {
+                a->ref = 1;
+                *ptail = a;
+                ptail = &a->place;
+            }
             return;
         }
-        a = a->next;
     }
 }
 
 //
-// Print out the Annotations.
+// Print out the Annotations placed since the last time, in the order
+// they were placed.
 void
 Annots::put(PDFfile *file)
 {
-    Annot   *a = list;
-    Annot   *b = 0;
-    Annot   *c;
-
-    while(a != 0) {
-        if (a->ref) {
-            Obj     *o = file->newObj();
-            a->put(o);
-            file->addAnnot(o);
-            c = a->next;
-            delete a;
-        } else {
-            c = a->next;
-            a->next = b;
-            b = a;
-        }
-        a = c;
+    Annot   *a, *n;
+    Annot   **l;
+
+    for (a = placed; a != 0; a = n) {
+        Obj     *o = file->newObj();
+        a->put(o);
+        file->addAnnot(o);
+        n = a->place;
+        l = &table[annot_hash(a->id) & (tsize - 1)];
+        while (*l != a)
+            l = &(*l)->next;
+        *l = a->next;
+        count--;
+        delete a;
     }
-    list = b;
+    placed = 0;
+    ptail = &placed;
 }
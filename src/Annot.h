@@ -51,11 +51,14 @@ friend class Annots;
         int             y;
         int             ref;
         char            *type;
-        Annot           *next;
+        Annot           *next;          // New ones, then those with the
+                                        // same hash.
+        Annot           *place;         // Next placed on the page.
 public:
 
         // Create an Annotation object.
-        Annot(Obj *o) : obj(o), id(0), x(0), y(0), ref(0), type(0), next(0) {};
+        Annot(Obj *o) : obj(o), id(0), x(0), y(0), ref(0), type(0), next(0),
+                        place(0) {};
         
         ~Annot() { delete[] id; delete[] type; obj = 0; next = 0; }
 
@@ -73,13 +76,45 @@ public:
 };
 
 
-// Handle list of annotations in this file.     
+// Handle list of annotations in this file. They are found by id in a
+// hash table, those placed on the page being built are kept in order
+// until it is put out.
 class   Annots  {
-        Annot   *list;
+        Annot           *list;          // Not yet in table.
+        Annot           **table;
+        unsigned int    tsize;          // Entries in table.
+        unsigned int    count;          // Annotations in table.
+        Annot           *placed;
+        Annot           **ptail;
+        Annot           *noid;          // Can't be placed, no id.
+
+        static Annot *reverse(Annot *a);
+
+        void index();
 public:
-        Annots() : list(0) {};
+        Annots() : list(0), table(0), tsize(0), count(0), placed(0),
+                   ptail(&placed), noid(0) {};
 
-        ~Annots() { }
+        ~Annots() {
+            Annot   *a, *n;
+            unsigned int i;
+
+            for (i = 0; i < tsize; i++) {
+                for (a = table[i]; a != 0; a = n) {
+                    n = a->next;
+                    delete a;
+                }
+            }
+            delete[] table;
+            for (a = reverse(list); a != 0; a = n) {
+                n = a->next;
+                delete a;
+            }
+            for (a = noid; a != 0; a = n) {
+                n = a->next;
+                delete a;
+            }
+        }
 
         void ref(char *name, int x, int y);
 
@@ -0,0 +1,122 @@
+//
+//
+// Copyright 2019 Richard P. Cornwell All Rights Reserved,
+//
+// The software is provided "as is", without warranty of any kind, express
+// or implied, including but not limited to the warranties of
+// merchantability, fitness for a particular purpose and non-infringement.
+// In no event shall Richard Cornwell be liable for any claim, damages
+// or other liability, whether in an action of contract, tort or otherwise,
+// arising from, out of or in connection with the software or the use or other
+// dealings in the software.
+//
+// Permission to use, copy, and distribute this software and its
+// documentation for non commercial use is hereby granted,
+// provided that the above copyright notice appear in all copies and that
+// both that copyright notice and this permission notice appear in
+// supporting documentation.
+//
+// The sale, resale, or use of this program for profit without the
+// express written consent of the author Richard Cornwell is forbidden.
+//
+// This program uses a XML control file to generate a PDF file. This is used
+// to convert listings and images into a more easy to read format. This program
+// is also capable of doing limited black and white processing to scanned images
+// to make them easier to read.
+
+// Memory for building a page.
+//
+// Pieces are handed out in order from large blocks and all given back at
+// once by reset when the page has been written, so building a page does
+// not go through malloc and free for every small buffer.
+
+#include <stdlib.h>
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+#define ARENA_BLOCK     (256 * 1024)
+
+class   Arena {
+        struct block {
+             struct block       *next;
+             size_t             size;
+        }       *list;          // Blocks in use, newest first.
+        struct block    *spare; // Blocks given back by reset.
+        char            *next;  // Free space in newest block.
+        size_t          left;
+
+public:
+        Arena() : list(0), spare(0), next(0), left(0) {}
+
+        ~Arena() {
+             reset();
+             while (spare != 0) {
+                 struct block   *b = spare->next;
+                 free(spare);
+                 spare = b;
+             }
+        }
+
+        // Get n bytes, aligned for any use.
+        void *alloc(size_t n) {
+             struct block       *b;
+             void               *p;
+
+             n = (n + 15) & ~(size_t)15;
+             if (n > left) {
+                 if (n > ARENA_BLOCK - 16) {
+                     // Too big to share a block, give it one of its own.
+                     b = (struct block *)malloc(n + 16);
+                     b->size = n + 16;
+                     if (list != 0) {
+                         b->next = list->next;
+                         list->next = b;
+                     } else {
+                         b->next = 0;
+                         list = b;
+                     }
+                     return (char *)b + 16;
+                 }
+                 if (spare != 0) {
+                     b = spare;
+                     spare = b->next;
+                 } else {
+                     b = (struct block *)malloc(ARENA_BLOCK);
+                     b->size = ARENA_BLOCK;
+                 }
+                 b->next = list;
+                 list = b;
+                 next = (char *)b + 16;
+                 left = ARENA_BLOCK - 16;
+             }
+             p = next;
+             next += n;
+             left -= n;
+             return p;
+        }
+
+        // Give everything back. Blocks of the usual size are kept for
+        // the next page.
+        void reset() {
+             while (list != 0) {
+                 struct block   *b = list->next;
+                 if (list->size == ARENA_BLOCK) {
+                     list->next = spare;
+                     spare = list;
+                 } else {
+                     free(list);
+                 }
+                 list = b;
+             }
+             next = 0;
+             left = 0;
+        }
+
+        // For zlib to take its state from.
+        static void *zalloc(void *arena, unsigned items, unsigned size) {
+             return ((Arena *)arena)->alloc((size_t)items * size);
+        }
+
+        static void zfree(void *, void *) {}
+};
+#endif
@@ -0,0 +1,266 @@
+//
+//
+// Copyright 2019 Richard P. Cornwell All Rights Reserved,
+//
+// The software is provided "as is", without warranty of any kind, express
+// or implied, including but not limited to the warranties of
+// merchantability, fitness for a particular purpose and non-infringement.
+// In no event shall Richard Cornwell be liable for any claim, damages
+// or other liability, whether in an action of contract, tort or otherwise,
+// arising from, out of or in connection with the software or the use or other
+// dealings in the software.
+//
+// Permission to use, copy, and distribute this software and its
+// documentation for non commercial use is hereby granted,
+// provided that the above copyright notice appear in all copies and that
+// both that copyright notice and this permission notice appear in
+// supporting documentation.
+//
+// The sale, resale, or use of this program for profit without the
+// express written consent of the author Richard Cornwell is forbidden.
+//
+// This program uses a XML control file to generate a PDF file. This is used
+// to convert listings and images into a more easy to read format. This program
+// is also capable of doing limited black and white processing to scanned images
+// to make them easier to read.
+
+// CCITT Group 4 fax encoding.
+//
+// Each row is turned into a list of the positions where the colour changes,
+// then coded against the list of the row above using the pass, vertical and
+// horizontal modes of T.6. The image is white above the first row. A 1 bit
+// in the image is white, so the PDF default of BlackIs1 false applies.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "CCITT.h"
+
+struct faxcode {
+        unsigned short  code;
+        unsigned char   len;
+};
+
+// White run lengths 0 to 63.
+static const struct faxcode white_term[] = {
+    {0x035,  8}, {0x007,  6}, {0x007,  4}, {0x008,  4},
+    {0x00b,  4}, {0x00c,  4}, {0x00e,  4}, {0x00f,  4},
+    {0x013,  5}, {0x014,  5}, {0x007,  5}, {0x008,  5},
+    {0x008,  6}, {0x003,  6}, {0x034,  6}, {0x035,  6},
+    {0x02a,  6}, {0x02b,  6}, {0x027,  7}, {0x00c,  7},
+    {0x008,  7}, {0x017,  7}, {0x003,  7}, {0x004,  7},
+    {0x028,  7}, {0x02b,  7}, {0x013,  7}, {0x024,  7},
+    {0x018,  7}, {0x002,  8}, {0x003,  8}, {0x01a,  8},
+    {0x01b,  8}, {0x012,  8}, {0x013,  8}, {0x014,  8},
+    {0x015,  8}, {0x016,  8}, {0x017,  8}, {0x028,  8},
+    {0x029,  8}, {0x02a,  8}, {0x02b,  8}, {0x02c,  8},
+    {0x02d,  8}, {0x004,  8}, {0x005,  8}, {0x00a,  8},
+    {0x00b,  8}, {0x052,  8}, {0x053,  8}, {0x054,  8},
+    {0x055,  8}, {0x024,  8}, {0x025,  8}, {0x058,  8},
+    {0x059,  8}, {0x05a,  8}, {0x05b,  8}, {0x04a,  8},
+    {0x04b,  8}, {0x032,  8}, {0x033,  8}, {0x034,  8}
+};
+
+// White run lengths 64 to 2560, in steps of 64.
+static const struct faxcode white_makeup[] = {
+    {0x01b,  5}, {0x012,  5}, {0x017,  6}, {0x037,  7},
+    {0x036,  8}, {0x037,  8}, {0x064,  8}, {0x065,  8},
+    {0x068,  8}, {0x067,  8}, {0x0cc,  9}, {0x0cd,  9},
+    {0x0d2,  9}, {0x0d3,  9}, {0x0d4,  9}, {0x0d5,  9},
+    {0x0d6,  9}, {0x0d7,  9}, {0x0d8,  9}, {0x0d9,  9},
+    {0x0da,  9}, {0x0db,  9}, {0x098,  9}, {0x099,  9},
+    {0x09a,  9}, {0x018,  6}, {0x09b,  9}, {0x008, 11},
+    {0x00c, 11}, {0x00d, 11}, {0x012, 12}, {0x013, 12},
+    {0x014, 12}, {0x015, 12}, {0x016, 12}, {0x017, 12},
+    {0x01c, 12}, {0x01d, 12}, {0x01e, 12}, {0x01f, 12}
+};
+
+// Black run lengths 0 to 63.
+static const struct faxcode black_term[] = {
+    {0x037, 10}, {0x002,  3}, {0x003,  2}, {0x002,  2},
+    {0x003,  3}, {0x003,  4}, {0x002,  4}, {0x003,  5},
+    {0x005,  6}, {0x004,  6}, {0x004,  7}, {0x005,  7},
+    {0x007,  7}, {0x004,  8}, {0x007,  8}, {0x018,  9},
+    {0x017, 10}, {0x018, 10}, {0x008, 10}, {0x067, 11},
+    {0x068, 11}, {0x06c, 11}, {0x037, 11}, {0x028, 11},
+    {0x017, 11}, {0x018, 11}, {0x0ca, 12}, {0x0cb, 12},
+    {0x0cc, 12}, {0x0cd, 12}, {0x068, 12}, {0x069, 12},
+    {0x06a, 12}, {0x06b, 12}, {0x0d2, 12}, {0x0d3, 12},
+    {0x0d4, 12}, {0x0d5, 12}, {0x0d6, 12}, {0x0d7, 12},
+    {0x06c, 12}, {0x06d, 12}, {0x0da, 12}, {0x0db, 12},
+    {0x054, 12}, {0x055, 12}, {0x056, 12}, {0x057, 12},
+    {0x064, 12}, {0x065, 12}, {0x052, 12}, {0x053, 12},
+    {0x024, 12}, {0x037, 12}, {0x038, 12}, {0x027, 12},
+    {0x028, 12}, {0x058, 12}, {0x059, 12}, {0x02b, 12},
+    {0x02c, 12}, {0x05a, 12}, {0x066, 12}, {0x067, 12}
+};
+
+// Black run lengths 64 to 2560, in steps of 64.
+static const struct faxcode black_makeup[] = {
+    {0x00f, 10}, {0x0c8, 12}, {0x0c9, 12}, {0x05b, 12},
+    {0x033, 12}, {0x034, 12}, {0x035, 12}, {0x06c, 13},
+    {0x06d, 13}, {0x04a, 13}, {0x04b, 13}, {0x04c, 13},
+    {0x04d, 13}, {0x072, 13}, {0x073, 13}, {0x074, 13},
+    {0x075, 13}, {0x076, 13}, {0x077, 13}, {0x052, 13},
+    {0x053, 13}, {0x054, 13}, {0x055, 13}, {0x05a, 13},
+    {0x05b, 13}, {0x064, 13}, {0x065, 13}, {0x008, 11},
+    {0x00c, 11}, {0x00d, 11}, {0x012, 12}, {0x013, 12},
+    {0x014, 12}, {0x015, 12}, {0x016, 12}, {0x017, 12},
+    {0x01c, 12}, {0x01d, 12}, {0x01e, 12}, {0x01f, 12}
+};
+
+// Vertical mode, a1 - b1 from -3 to 3.
+static const struct faxcode vert[] = {
+    {0x02,  7}, {0x02,  6}, {0x02,  3}, {0x01,  1},
+    {0x03,  3}, {0x03,  6}, {0x03,  7}
+};
+
+#define PASS_CODE       0x1     // 0001
+#define PASS_LEN        4
+#define HORZ_CODE       0x1     // 001
+#define HORZ_LEN        3
+#define EOL_CODE        0x001   // 000000000001
+#define EOL_LEN         12
+
+//
+// Encode an image of packed 1 bit rows. The result is left in out.
+void
+CCITT::encode(unsigned char *data, int width, int height, int row_width)
+{
+    int             *ref, *cur, *t;
+    int             a0, a1, a2, b1, b2;
+    int             ka, kb, k;
+    int             color;
+    int             i;
+
+    delete[] out;
+    len = 0;
+    acc = 0;
+    bits = 0;
+    size = (row_width * height) / 8 + 1024;
+    out = new unsigned char[size];
+    ref = new int[width + 4];
+    cur = new int[width + 4];
+    // Row above the image is all white.
+    for (i = 0; i < 4; i++)
+         ref[i] = width;
+    for (i = 0; i < height; i++) {
+        changes(&data[i * row_width], width, row_width, cur);
+        // Worst case is a horizontal code for every pixel pair.
+        grow(3 * width + 16);
+        a0 = -1;
+        color = 0;
+        ka = kb = 0;
+        while (a0 < width) {
+            while (cur[ka] <= a0)
+                ka++;
+            a1 = cur[ka];
+            while (ref[kb] <= a0)
+                kb++;
+            // b1 must change to the opposite of the colour at a0.
+            k = kb + ((kb & 1) != color);
+            b1 = ref[k];
+            b2 = ref[k + 1];
+            if (b2 < a1) {
+                putbits(PASS_CODE, PASS_LEN);
+                a0 = b2;
+            } else if (a1 - b1 <= 3 && b1 - a1 <= 3) {
+                putbits(vert[a1 - b1 + 3].code, vert[a1 - b1 + 3].len);
+                a0 = a1;
+                color = !color;
+            } else {
+                a2 = cur[ka + 1];
+                putbits(HORZ_CODE, HORZ_LEN);
+                putrun(a1 - ((a0 < 0) ? 0 : a0), color);
+                putrun(a2 - a1, !color);
+                a0 = a2;
+            }
+        }
+        t = ref;
+        ref = cur;
+        cur = t;
+    }
+    // End of facsimile block, then fill out the last byte.
+    grow(8);
+    putbits(EOL_CODE, EOL_LEN);
+    putbits(EOL_CODE, EOL_LEN);
+    if (bits != 0)
+        putbits(0, 8 - bits);
+    delete[] ref;
+    delete[] cur;
+}
+
+//
+// Make a list of the pixels where the colour changes from the one before.
+// Rows start white, the list is ended by four copies of width. Rows are
+// scanned 64 pixels at a time, a word that matches the current colour is
+// skipped without looking at the bits.
+int
+CCITT::changes(unsigned char *row, int width, int row_width, int *list)
+{
+    uint64_t        w, x, pat;
+    int             n = 0;
+    int             i, j, pos;
+
+    pat = ~(uint64_t)0;
+    for (i = 0; i < row_width; i += 8) {
+        if (i + 8 <= row_width) {
+            memcpy(&w, &row[i], 8);
+            w = __builtin_bswap64(w);
+        } else {
+            w = 0;
+            for (j = 0; j < 8; j++) 
+                w = (w << 8) | ((i + j < row_width) ? row[i + j] : 0);
+        }
+        x = w ^ pat;
+        while (x != 0) {
+            pos = __builtin_clzll(x);
+            if ((i << 3) + pos >= width) 
+                goto done;
+            list[n++] = (i << 3) + pos;
+            x ^= ~(uint64_t)0 >> pos;
+            pat = ~pat;
+        }
+    }
+done:
+    for (j = 0; j < 4; j++)
+         list[n + j] = width;
+    return n;
+}
+
+//
+// Put out the codes for a run of one colour, 0 is white.
+void
+CCITT::putrun(int run, int color)
+{
+    const struct faxcode *term = color ? black_term : white_term;
+    const struct faxcode *makeup = color ? black_makeup : white_makeup;
+
+    while (run >= 2560 + 64) {
+        putbits(makeup[39].code, makeup[39].len);
+        run -= 2560;
+    }
+    if (run >= 64) {
+        putbits(makeup[(run >> 6) - 1].code, makeup[(run >> 6) - 1].len);
+        run &= 63;
+    }
+    putbits(term[run].code, term[run].len);
+}
+
+//
+// Make sure there is room for need more bytes.
+void
+CCITT::grow(unsigned int need)
+{
+    unsigned char   *n;
+
+    if (len + need <= size)
+        return;
+    while (len + need > size)
+        size *= 2;
+    n = new unsigned char[size];
+    memcpy(n, out, len);
+    delete[] out;
+    out = n;
+}
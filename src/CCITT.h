@@ -0,0 +1,66 @@
+//
+//
+// Copyright 2019 Richard P. Cornwell All Rights Reserved,
+//
+// The software is provided "as is", without warranty of any kind, express
+// or implied, including but not limited to the warranties of
+// merchantability, fitness for a particular purpose and non-infringement.
+// In no event shall Richard Cornwell be liable for any claim, damages
+// or other liability, whether in an action of contract, tort or otherwise,
+// arising from, out of or in connection with the software or the use or other
+// dealings in the software.
+//
+// Permission to use, copy, and distribute this software and its
+// documentation for non commercial use is hereby granted,
+// provided that the above copyright notice appear in all copies and that
+// both that copyright notice and this permission notice appear in
+// supporting documentation.
+//
+// The sale, resale, or use of this program for profit without the
+// express written consent of the author Richard Cornwell is forbidden.
+//
+// This program uses a XML control file to generate a PDF file. This is used
+// to convert listings and images into a more easy to read format. This program
+// is also capable of doing limited black and white processing to scanned images
+// to make them easier to read.
+
+// CCITT Group 4 (T.6) encoding of 1 bit images.
+#include <stdint.h>
+
+#ifndef _CCITT_H_
+#define _CCITT_H_
+class   CCITT {
+public:
+        unsigned char   *out;           // Encoded data.
+        unsigned int    len;            // Number of bytes in out.
+private:
+        unsigned int    size;           // Space allocated for out.
+        uint32_t        acc;            // Bits not yet put into out.
+        int             bits;           // Number of bits in acc.
+
+public:
+        CCITT() : out(0), len(0), size(0), acc(0), bits(0) {};
+
+        ~CCITT() { delete[] out; };
+
+        void encode(unsigned char *data, int width, int height,
+                    int row_width);
+
+private:
+        int changes(unsigned char *row, int width, int row_width, int *list);
+
+        void putrun(int run, int color);
+
+        void grow(unsigned int need);
+
+        // Add the low n bits of code to the output, first bit is the MSB.
+        void putbits(unsigned int code, int n) {
+             acc = (acc << n) | code;
+             bits += n;
+             while (bits >= 8) {
+                 bits -= 8;
+                 out[len++] = (unsigned char)(acc >> bits);
+             }
+        }
+};
+#endif
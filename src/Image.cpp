@@ -27,20 +27,177 @@
 // Process images
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <png.h>
+#include <setjmp.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "Obj.h"
 #include "Stream.h"
 #include "Image.h"
+#include "CCITT.h"
+#include "JBIG2.h"
 
 extern int      verbose;
 
+// Bit reversed value of every byte, used to mirror packed 1 bit rows.
+static unsigned char    rev_byte[256];
+static int              rev_init = 0;
+
+static void
+init_rev_byte()
+{
+    int     i, j;
+
+    for (i = 0; i < 256; i++) {
+        rev_byte[i] = 0;
+        for (j = 0; j < 8; j++) {
+            if (i & (1 << j))
+                rev_byte[i] |= 0x80 >> j;
+        }
+    }
+    rev_init = 1;
+}
+
+// Reverse the order of all bits in a word.
+static inline uint64_t
+rev64(uint64_t x)
+{
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    x = ((x >> 8) & 0x00FF00FF00FF00FFULL) | ((x & 0x00FF00FF00FF00FFULL) << 8);
+    x = ((x >> 16) & 0x0000FFFF0000FFFFULL) | ((x & 0x0000FFFF0000FFFFULL) << 16);
+    return (x >> 32) | (x << 32);
+}
+
+// Transpose a 64x64 bit matrix held one row per word, first column in
+// the high bit of each word.
+static void
+transpose64(uint64_t *a)
+{
+    int         j, k, l;
+    uint64_t    m, t;
+
+    for (j = 32, m = 0x00000000FFFFFFFFULL; j != 0; j >>= 1, m ^= m << j) {
+        for (k = 0; k < 64; k += j * 2) {
+            for (l = k; l < k + j; l++) {
+                t = (a[l] ^ (a[l + j] >> j)) & m;
+                a[l] ^= t;
+                a[l + j] ^= t << j;
+            }
+        }
+    }
+}
+
+#ifdef __SSE2__
+// Transpose a 16x16 block of bytes.
+// Four rounds of interleaves leave the columns in bit reversed order.
+static inline void
+transpose_tile(const unsigned char *sp, int ss, unsigned char *dp, int ds)
+{
+    static const int    order[16] = { 0, 8, 4, 12, 2, 10, 6, 14,
+                                      1, 9, 5, 13, 3, 11, 7, 15 };
+    __m128i             a[16], b[16];
+    int                 i;
+
+    for (i = 0; i < 16; i++)
+        a[i] = _mm_loadu_si128((const __m128i *)(sp + (i * ss)));
+    for (i = 0; i < 8; i++) {
+        b[i] = _mm_unpacklo_epi8(a[2*i], a[2*i+1]);
+        b[i+8] = _mm_unpackhi_epi8(a[2*i], a[2*i+1]);
+    }
+    for (i = 0; i < 8; i++) {
+        a[i] = _mm_unpacklo_epi16(b[2*i], b[2*i+1]);
+        a[i+8] = _mm_unpackhi_epi16(b[2*i], b[2*i+1]);
+    }
+    for (i = 0; i < 8; i++) {
+        b[i] = _mm_unpacklo_epi32(a[2*i], a[2*i+1]);
+        b[i+8] = _mm_unpackhi_epi32(a[2*i], a[2*i+1]);
+    }
+    for (i = 0; i < 8; i++) {
+        a[i] = _mm_unpacklo_epi64(b[2*i], b[2*i+1]);
+        a[i+8] = _mm_unpackhi_epi64(b[2*i], b[2*i+1]);
+    }
+    for (i = 0; i < 16; i++)
+        _mm_storeu_si128((__m128i *)(dp + (order[i] * ds)), a[i]);
+}
+#define TILE    16
+#else
+// Transpose a 16x16 block of bytes.
+static inline void
+transpose_tile(const unsigned char *sp, int ss, unsigned char *dp, int ds)
+{
+    int     i, j;
+
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < 16; j++)
+            dp[(j * ds) + i] = sp[j];
+        sp += ss;
+    }
+}
+#define TILE    16
+#endif
+
+// Transpose w by h bytes at sp into h by w bytes at dp.
+// Work is done in 64x64 blocks of 16x16 tiles so both the rows read and
+// the rows written stay in cache, odd edges are copied a byte at a time.
+static void
+transpose_bytes(const unsigned char *sp, int ss, unsigned char *dp, int ds,
+                int w, int h)
+{
+    int     bx, by, x, y;
+    int     ex, ey;
+    int     tw = w - (w % TILE);
+    int     th = h - (h % TILE);
+
+    for (by = 0; by < th; by += 64) {
+        ey = (by + 64 < th) ? by + 64 : th;
+        for (bx = 0; bx < tw; bx += 64) {
+            ex = (bx + 64 < tw) ? bx + 64 : tw;
+            for (y = by; y < ey; y += TILE) {
+                for (x = bx; x < ex; x += TILE)
+                    transpose_tile(&sp[(y * ss) + x], ss,
+                                   &dp[(x * ds) + y], ds);
+            }
+        }
+    }
+    // Right edge columns.
+    for (y = 0; y < h; y++) {
+        for (x = tw; x < w; x++)
+            dp[(x * ds) + y] = sp[(y * ss) + x];
+    }
+    // Bottom edge rows.
+    for (x = 0; x < tw; x++) {
+        for (y = th; y < h; y++)
+            dp[(x * ds) + y] = sp[(y * ss) + x];
+    }
+}
+
+// Dots per inch of dots per unit, where an inch is num / den units.
+// Zero if it makes no sense.
+static int
+to_dpi(uint64_t dots, int num, int den)
+{
+    uint64_t        d = (dots * num + den / 2) / den;
+
+    return (d > 0 && d <= 100000) ? (int)d : 0;
+}
+
 //
-// Load an image file into memory. Currently supports PNG files.
+// Load an image file into memory. Currently supports PNG and JPEG files.
 int
 Image::open(xmlChar *name)
 {
@@ -48,7 +205,9 @@ Image::open(xmlChar *name)
     png_structp     png_ptr;
     png_infop       info_ptr, end_ptr;
     png_bytep       *row_pointers;
-    int             i;
+    png_colorp      pal;
+    png_uint_32     rx, ry;
+    int             i, n;
     unsigned char   *dp;
 
     f = fopen((const char *)name, "r");
@@ -56,6 +215,11 @@ Image::open(xmlChar *name)
         fprintf(stderr, "Could not open image %s\n", name);
         return 0;
     }
+    if (getc(f) == 0xff && getc(f) == 0xd8) {
+        rewind(f);
+        return openJPEG(f, name);
+    }
+    rewind(f);
     if (verbose)
         fprintf(stderr, "Reading image %s\n", name);
     png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
@@ -89,69 +253,566 @@ Image::open(xmlChar *name)
     height = png_get_image_height(png_ptr, info_ptr);
     row_width = png_get_rowbytes(png_ptr, info_ptr);
     bpp = png_get_bit_depth(png_ptr, info_ptr);
+    if (png_get_pHYs(png_ptr, info_ptr, &rx, &ry, &i) &&
+            i == PNG_RESOLUTION_METER && (n = to_dpi(rx, 254, 10000)) != 0)
+        dpi = n;
+    // Palette images keep their packed indices, color ones their RGB.
+    colors = 1;
+    i = png_get_color_type(png_ptr, info_ptr);
+    if (i == PNG_COLOR_TYPE_PALETTE) {
+        if (png_get_PLTE(png_ptr, info_ptr, &pal, &n) & PNG_INFO_PLTE) {
+            palette = new unsigned char[3 * 256];
+            memset(palette, 0, 3 * 256);
+            for (i = 0; i < n && i < 256; i++) {
+                palette[3 * i] = pal[i].red;
+                palette[3 * i + 1] = pal[i].green;
+                palette[3 * i + 2] = pal[i].blue;
+            }
+            pal_size = i;
+        }
+    } else if (i & PNG_COLOR_MASK_COLOR) {
+        colors = 3;
+    }
     row_pointers = png_get_rows(png_ptr, info_ptr);
     data = new unsigned char[row_width * height];
     dp = data;
+    // libpng leaves the bits past the end of a row as they were, clear
+    // them so the same image always hashes the same.
+    n = (width * bpp * colors) & 7;
     for(i = 0; i < height; i++) {
         memcpy(dp, row_pointers[i], row_width);
+        if (n != 0)
+            dp[row_width - 1] &= 0xff << (8 - n);
         dp += row_width;
     }
     png_destroy_read_struct(&png_ptr, &info_ptr, &end_ptr);
     fclose(f);
+    if (verbose)
+        fprintf(stderr, "   Width %d (%d) Height %d BPP %d Colors %d\n",
+                    width, row_width, height, bpp,
+                    (palette != 0) ? -pal_size : colors);
+
+    hist_ok = 0;
+    mapped = 0;
+    idat = 0;
+    dct = 0;
+    return 1;
+}
+
+#ifdef HAVE_LIBJPEG
+// Error handler for libjpeg, returns to the setjmp in openJPEG.
+struct jpeg_fail {
+        struct jpeg_error_mgr   pub;
+        jmp_buf                 jmp;
+};
+
+static void
+jpeg_error(j_common_ptr cinfo)
+{
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(((struct jpeg_fail *)cinfo->err)->jmp, 1);
+}
+#endif
+
+//
+// Decode a JPEG file into an RGB or gray scale image.
+int
+Image::openJPEG(FILE *f, xmlChar *name)
+{
+#ifdef HAVE_LIBJPEG
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_fail jerr;
+    JSAMPROW        row;
+
+    if (verbose)
+        fprintf(stderr, "Reading image %s\n", name);
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(f);
+        delete[] data;
+        data = 0;
+        fprintf(stderr, "Error reading JPEG file %s\n", name);
+        return 0;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, f);
+    jpeg_read_header(&cinfo, TRUE);
+    if (cinfo.saw_JFIF_marker && cinfo.density_unit != 0) {
+        int d = to_dpi(cinfo.X_density, (cinfo.density_unit == 2) ? 254 : 1,
+                       (cinfo.density_unit == 2) ? 100 : 1);
+        if (d != 0)
+            dpi = d;
+    }
+    colors = (cinfo.num_components == 3) ? 3 : 1;
+    cinfo.out_color_space = (colors == 3) ? JCS_RGB : JCS_GRAYSCALE;
+    jpeg_start_decompress(&cinfo);
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    row_width = width * colors;
+    bpp = 8;
+    data = new unsigned char[row_width * height];
+    while (cinfo.output_scanline < cinfo.output_height) {
+        row = &data[cinfo.output_scanline * row_width];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(f);
     if (verbose)
         fprintf(stderr, "   Width %d (%d) Height %d BPP %d\n", width,
                     row_width, height, bpp);
+    hist_ok = 0;
+    mapped = 0;
+    idat = 0;
+    dct = 0;
+    return 1;
+#else
+    fclose(f);
+    fprintf(stderr, "Can't process JPEG file %s, no JPEG library\n", name);
+    return 0;
+#endif
+}
 
-    // If gray scale image, create histogram and map for image.
-    if (bpp == 8) {
-       int min = 128;
-       int max = 128;
-       unsigned char map[256];
-       float  scale;
-       memset(hist, 0, sizeof(hist));
-       dp = data;
-       for (i = row_width * height; i > 0; i--) 
-            hist[(int)*dp++]++;
-       for (i = 0; i < 128; i++) {
-            if (hist[i] != 0) {
-               min = i;
-               break;
-            }
-       }
-       for (i = 255; i > 128; i--) {
-            if (hist[i] != 0) {
-               max = i;
-               break;
+//
+// Keep a JPEG file as is, to be sent with the DCTDecode filter. Only the
+// JFIF and frame headers are looked at, for the resolution, size and
+// number of components. Files of more than limit dots per inch are
+// decoded, to be made smaller.
+int
+Image::loadJPEG(FILE *f, xmlChar *name, int limit)
+{
+    unsigned char   *p, *end;
+    long            sz;
+    int             m, l, d;
+
+    // The size is kept in an int, as dct.
+    if (fseek(f, 0, SEEK_END) != 0 || (sz = ftell(f)) < 4 || sz > INT_MAX) {
+        fclose(f);
+        fprintf(stderr, "Could not get size of JPEG file %s\n", name);
+        return 0;
+    }
+    rewind(f);
+    data = new unsigned char[sz];
+    if (fread(data, 1, sz, f) != (size_t)sz) {
+        delete[] data;
+        data = 0;
+        fclose(f);
+        fprintf(stderr, "Error reading JPEG file %s\n", name);
+        return 0;
+    }
+    p = data + 2;
+    end = data + sz;
+    width = 0;
+    while (p + 4 <= end && p[0] == 0xff) {
+        m = p[1];
+        if (m == 0xff) {            // Fill byte.
+            p++;
+            continue;
+        }
+        if (m == 0x01 || (m >= 0xd0 && m <= 0xd7)) {
+            p += 2;
+            continue;
+        }
+        l = (p[2] << 8) | p[3];
+        // JFIF header, units of 1 for inches and 2 for centimeters.
+        if (m == 0xe0 && l >= 16 && p + 18 <= end &&
+                memcmp(&p[4], "JFIF", 5) == 0 && (p[11] == 1 || p[11] == 2)) {
+            d = to_dpi((p[12] << 8) | p[13], (p[11] == 2) ? 254 : 1,
+                       (p[11] == 2) ? 100 : 1);
+            if (d != 0)
+                dpi = d;
+        }
+        // Start of frame, other than DHT, JPG and DAC.
+        if (m >= 0xc0 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc) {
+            if (p + 10 <= end) {
+                bpp = p[4];
+                height = (p[5] << 8) | p[6];
+                width = (p[7] << 8) | p[8];
+                colors = p[9];
             }
-       }
-       scale = 256.0 / ((float)(max - min));
-       for (i = 0; i <= 255; i++) {
-            int k = (int)(((float)(i - min))*scale);
-            if (k < 0)
-                k = 0;
-            if (k > 255)
-                k = 255;
-            map[i] = k;
-       }
+            break;
+        }
+        if (m == 0xda)              // Start of scan, no frame found.
+            break;
+        p += 2 + l;
+    }
+    if (width == 0 || height == 0 || bpp != 8 || (colors != 1 && colors != 3) ||
+            (limit != 0 && dpi > limit)) {
+        delete[] data;
+        data = 0;
+        colors = 1;
+        rewind(f);
+        return openJPEG(f, name);
+    }
+    fclose(f);
+    dct = sz;
+    idat = 0;
+    row_width = width * colors;
+    hist_ok = 0;
+    mapped = 0;
+    if (verbose)
+        fprintf(stderr, "Copying image %s\n   Width %d Height %d Colors %d\n",
+                    name, width, height, colors);
+    return 1;
+}
+
+// Fetch a 4 byte big endian value.
+static unsigned int
+get32(const unsigned char *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+//
+// Load a PNG or JPEG file without decoding it, for images that are sent
+// as is. Gray and color JPEG files are kept whole for DCTDecode. Gray,
+// palette and 8 bit RGB PNG images that are not interlaced have the same
+// layout as a PDF Flate stream with PNG predictors, so the IDAT chunks are
+// just collected up. Anything else is read with open, as are images of
+// more than limit dots per inch so they can be made smaller.
+int
+Image::load(xmlChar *name, int limit)
+{
+    static const unsigned char sig[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+    FILE            *f;
+    struct stat     st;
+    unsigned char   hdr[8];
+    unsigned char   ihdr[13];
+    unsigned char   phys[9];
+    unsigned char   *n;
+    unsigned int    len;
+    unsigned int    size;
+    int             d;
+    int             ok = 0;
+    int             bad = 0;
 
-       memset(hist, 0, sizeof(hist));
-       dp = data;
-       for (i = (row_width * height)-1; i > 0; i--, dp++) 
-            hist[(int)(*dp = map[(int)*dp])]++;
+    f = fopen((const char *)name, "r");
+    if (!f) 
+        return open(name);
+    if (fread(hdr, 1, 8, f) != 8) {
+        fclose(f);
+        return open(name);
+    }
+    if (hdr[0] == 0xff && hdr[1] == 0xd8) 
+        return loadJPEG(f, name, limit);
+    if (memcmp(hdr, sig, 8) != 0) {
+        fclose(f);
+        return open(name);
+    }
+    // No chunk can be longer than the file, which keeps the IDAT
+    // data in an int.
+    if (fstat(fileno(f), &st) != 0 || st.st_size > INT_MAX) {
+        fclose(f);
+        return open(name);
+    }
+    size = 0;
+    idat = 0;
+    data = 0;
+    while (fread(hdr, 1, 8, f) == 8) {
+        len = get32(hdr);
+        if (len > st.st_size - ftell(f)) {
+            bad = 1;
+            break;
+        }
+        if (memcmp(&hdr[4], "IHDR", 4) == 0) {
+            if (len != 13 || fread(ihdr, 1, 13, f) != 13) 
+                break;
+            width = get32(&ihdr[0]);
+            height = get32(&ihdr[4]);
+            bpp = ihdr[8];
+            // Gray, RGB or palette, deflate, adaptive filters, not
+            // interlaced.
+            if ((ihdr[9] != 0 && ihdr[9] != 2 && ihdr[9] != 3) ||
+                        ihdr[10] != 0 || ihdr[11] != 0 || ihdr[12] != 0 ||
+                        bpp > 8 || (ihdr[9] == 2 && bpp != 8))
+                break;
+            colors = (ihdr[9] == 2) ? 3 : 1;
+            len = 0;
+        } else if (memcmp(&hdr[4], "PLTE", 4) == 0) {
+            if (len > 3 * 256 || (len % 3) != 0 || palette != 0)
+                break;
+            palette = new unsigned char[3 * 256];
+            memset(palette, 0, 3 * 256);
+            if (fread(palette, 1, len, f) != len)
+                break;
+            pal_size = len / 3;
+            len = 0;
+        } else if (memcmp(&hdr[4], "pHYs", 4) == 0) {
+            if (len != 9 || fread(phys, 1, 9, f) != 9)
+                break;
+            // Pixels per meter.
+            if (phys[8] == 1 && (d = to_dpi(get32(phys), 254, 10000)) != 0)
+                dpi = d;
+            len = 0;
+        } else if (memcmp(&hdr[4], "IDAT", 4) == 0) {
+            if (limit != 0 && dpi > limit)
+                break;
+            if (idat + len > size) {
+                size = (size == 0) ? len : size;
+                while (idat + len > size)
+                    size *= 2;
+                n = new unsigned char[size];
+                if (data != 0) {
+                    memcpy(n, data, idat);
+                    delete[] data;
+                }
+                data = n;
+            }
+            if (fread(&data[idat], 1, len, f) != len) 
+                break;
+            idat += len;
+            len = 0;
+        } else if (memcmp(&hdr[4], "IEND", 4) == 0) {
+            ok = (width != 0 && idat != 0 &&
+                  (ihdr[9] != 3 || palette != 0));
+            break;
+        }
+        // Skip the rest of the chunk and its CRC.
+        if (fseek(f, len + 4, SEEK_CUR) != 0) 
+            break;
+    }
+    fclose(f);
+    if (!ok) {
+        delete[] data;
+        data = 0;
+        idat = 0;
+        width = height = 0;
+        delete[] palette;
+        palette = 0;
+        pal_size = 0;
+        colors = 1;
+        if (bad) {
+            fprintf(stderr, "Bad chunk length in PNG file %s\n", name);
+            return 0;
+        }
+        return open(name);
+    }
+    if (ihdr[9] != 3) {
+        delete[] palette;
+        palette = 0;
+        pal_size = 0;
     }
+    row_width = (width * bpp * colors + 7) / 8;
+    hist_ok = 0;
+    mapped = 0;
+    if (verbose)
+        fprintf(stderr, "Copying image %s\n   Width %d (%d) Height %d BPP %d\n",
+                    name, width, row_width, height, bpp);
     return 1;
 }
 
+//
+// Count the values in data, if not already done.
+void
+Image::count()
+{
+    unsigned char   *dp;
+    int             i;
+
+    if (hist_ok)
+        return;
+    memset(hist, 0, sizeof(hist));
+    if (palette != 0) {
+        // Count the indices, then the components of the entries they use.
+        unsigned long int n[256];
+        unsigned char     row[width];
+        int               j;
+
+        memset(n, 0, sizeof(n));
+        for (j = 0; j < height; j++) {
+            unpackrow(width, &data[j * row_width], row);
+            for (i = 0; i < width; i++)
+                n[row[i]]++;
+        }
+        for (i = 0; i < 3 * 256; i++)
+            hist[palette[i]] += n[i / 3];
+        hist_ok = 1;
+        return;
+    }
+    dp = data;
+    for (i = row_width * height; i > 0; i--) 
+         hist[(int)*dp++]++;
+    hist_ok = 1;
+}
+
+// Brightness of an RGB pixel.
+static inline int
+luma(const unsigned char *p)
+{
+    return (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+}
+
+//
+// Turn an indexed or RGB image into a byte per component. Gray asks for a
+// gray scale image, otherwise indexed images become RGB unless all their
+// entries are gray.
+void
+Image::convert(int gray)
+{
+    unsigned char   row[width];
+    unsigned char   *nimage;
+    unsigned char   *sp, *op, *p;
+    int             n, i, j;
+
+    if (palette == 0 && (colors == 1 || !gray))
+        return;
+    applyMap();
+    if (palette != 0 && !gray) {
+        gray = 1;
+        for (i = 0; i < pal_size; i++) {
+            p = &palette[3 * i];
+            if (p[0] != p[1] || p[0] != p[2])
+                gray = 0;
+        }
+    }
+    n = (gray) ? 1 : 3;
+    if (verbose)
+        fprintf(stderr, "    convert to %s\n", (gray) ? "gray" : "RGB");
+    nimage = new unsigned char[width * height * n];
+    for (j = 0; j < height; j++) {
+        sp = &data[j * row_width];
+        op = &nimage[j * width * n];
+        if (palette == 0) {
+            for (i = 0; i < width; i++, sp += 3)
+                *op++ = luma(sp);
+            continue;
+        }
+        unpackrow(width, sp, row);
+        for (i = 0; i < width; i++) {
+            p = &palette[3 * row[i]];
+            if (gray) {
+                *op++ = luma(p);
+            } else {
+                *op++ = p[0];
+                *op++ = p[1];
+                *op++ = p[2];
+            }
+        }
+    }
+    delete[] data;
+    data = nimage;
+    delete[] palette;
+    palette = 0;
+    pal_size = 0;
+    bpp = 8;
+    colors = n;
+    row_width = width * n;
+    hist_ok = 0;
+}
+
+//
+// Histogram of the image as it will be once the pending map is applied.
+void
+Image::histogram(unsigned long int *h)
+{
+    int             i;
+
+    count();
+    if (!mapped) {
+        memcpy(h, hist, sizeof(hist));
+        return;
+    }
+    memset(h, 0, sizeof(hist));
+    for (i = 0; i < 256; i++)
+         h[map[i]] += hist[i];
+}
+
+//
+// Add a point operation to the pending map. Nothing touches the pixels
+// until applyMap or thresh is called.
+void
+Image::addMap(unsigned char *m)
+{
+    int             i;
+
+    for (i = 0; i < 256; i++)
+         map[i] = m[mapped ? map[i] : i];
+    mapped = 1;
+}
+
+//
+// Run the pending map over the image. The new histogram follows from the
+// old one, so it does not need another pass. Indexed images only need
+// their palette mapped.
+void
+Image::applyMap()
+{
+    unsigned long int h[256];
+    unsigned char   *dp;
+    int             i;
+
+    if (!mapped)
+        return;
+    if (hist_ok) {
+        histogram(h);
+        memcpy(hist, h, sizeof(hist));
+    }
+    if (palette != 0) {
+        for (i = 0; i < 3 * 256; i++)
+            palette[i] = map[palette[i]];
+        mapped = 0;
+        return;
+    }
+    dp = data;
+    for (i = row_width * height; i > 0; i--, dp++) 
+         *dp = map[(int)*dp];
+    mapped = 0;
+}
+
+//
+// Stretch the used range of gray levels out to 0 to 255.
+void
+Image::normalize()
+{
+    unsigned long int h[256];
+    unsigned char   m[256];
+    int             min = 128;
+    int             max = 128;
+    float           scale;
+    int             i;
+
+    if (bpp != 8 && palette == 0) 
+        return;
+    histogram(h);
+    for (i = 0; i < 128; i++) {
+        if (h[i] != 0) {
+           min = i;
+           break;
+        }
+    }
+    for (i = 255; i > 128; i--) {
+        if (h[i] != 0) {
+           max = i;
+           break;
+        }
+    }
+    scale = 256.0 / ((float)(max - min));
+    for (i = 0; i < 256; i++) {
+        int k = (int)(((float)(i - min))*scale);
+        if (k < 0)
+            k = 0;
+        if (k > 255)
+            k = 255;
+        m[i] = k;
+    }
+    addMap(m);
+}
+
 //
 // Compute average brightness, then set threshold for B/W conversion to this value.
 void
 Image::avg(int value)
 {
+    unsigned long int h[256];
     int     i, j, k, th;
 
+    convert(1);
     if (bpp != 8) 
         return;
 
+    histogram(h);
     th = 127;
     for(k = 64; k > 0; k /= 2) {
         int         sl, sh;
@@ -159,9 +820,9 @@ Image::avg(int value)
         sl = sh = 0;
         for(i = 1; i < 255; i++) {
             if (i < th)
-               sl += hist[i];
+               sl += h[i];
             else 
-               sh += hist[i];
+               sh += h[i];
         }
         nth = 8 * sl;
         nth -= sh;
@@ -181,40 +842,582 @@ Image::avg(int value)
     thresh(th + value);
 }
 
+#ifdef __SSE2__
+// Pack the pixels of a gray row that are at least c into bits, 32 at a time.
+// The compare mask comes out first pixel in the low bit, so each byte of it
+// goes through the bit reversal table. Returns the number of pixels done,
+// the caller packs the rest.
+static int
+pack_step(const unsigned char *sp, unsigned char *op, int w, int c)
+{
+    __m128i     lim = _mm_set1_epi8((char)c);
+    __m128i     a, b;
+    unsigned    m;
+    int         i;
+
+    for (i = 0; i + 32 <= w; i += 32) {
+        a = _mm_loadu_si128((const __m128i *)(sp + i));
+        b = _mm_loadu_si128((const __m128i *)(sp + i + 16));
+        a = _mm_cmpeq_epi8(_mm_max_epu8(a, lim), a);
+        b = _mm_cmpeq_epi8(_mm_max_epu8(b, lim), b);
+        m = _mm_movemask_epi8(a) | (_mm_movemask_epi8(b) << 16);
+        op[0] = rev_byte[m & 0xff];
+        op[1] = rev_byte[(m >> 8) & 0xff];
+        op[2] = rev_byte[(m >> 16) & 0xff];
+        op[3] = rev_byte[m >> 24];
+        op += 4;
+    }
+    return i;
+}
+#endif
+
 //
 // All pixels below the threshhold are made black, all above white.
-// Image type made into B/W image.
+// Image type made into B/W image. Any pending map is folded into the
+// compare, so the gray image is only read once.
 void
 Image::thresh(int value)
 {
     unsigned char   *nimage;
     unsigned char   *dp, *op;
+    unsigned char   on[256];
     int             rw;
     int             i, j, k;
+    int             b;
+    int             step;
     
+    convert(1);
     if (bpp != 8) 
        return;
 
+    for (i = 0; i < 256; i++)
+         on[i] = (mapped ? map[i] : i) > value;
+    // If the map keeps the order of the gray levels the test is still a
+    // single compare, against the first level that comes out white.
+    for (step = 0; step < 256 && !on[step]; step++)
+         ;
+    for (i = step; i < 256 && on[i]; i++)
+         ;
+    if (i != 256 || step == 256)
+        step = -1;
+    if (!rev_init)
+        init_rev_byte();
     rw = (width >> 3) + ((width & 7) != 0);
     nimage = new unsigned char[rw * height];
-    memset(nimage, 0, rw * height);
-    dp = data;
     for(j = 0; j < height; j++) {
+        dp = &data[j * row_width];
         op = &nimage[j * rw];
-        k = 7;
-        for (i = 0; i < row_width; i++) {
-             if (*dp++ > value) 
-                 *op |= 1 << k;
-             if (k-- == 0) {
-                 op++;
-                 k = 7;
-             }
+        i = width;
+#ifdef __SSE2__
+        if (step >= 0) {
+            k = pack_step(dp, op, width, step);
+            dp += k;
+            op += k >> 3;
+            i -= k;
+        }
+#endif
+        for (; i >= 8; i -= 8) {
+             b = 0;
+             for (k = 0; k < 8; k++)
+                 b = (b << 1) | on[*dp++];
+             *op++ = b;
+        }
+        if (i > 0) {
+             b = 0;
+             for (k = 0; k < i; k++)
+                 b = (b << 1) | on[*dp++];
+             *op++ = b << (8 - i);
         }
     }
     delete[] data;
     data = nimage;
     row_width = rw;
     bpp = 1;
+    mapped = 0;
+    hist_ok = 0;
+}
+
+// A strip of output rows for one downsample worker. Source pixels are num
+// units wide and output pixels are den, so every output pixel is the
+// average of the den by den square of units under it. Pixels are nc bytes,
+// each averaged on its own.
+struct ds_job {
+    const unsigned char *src;
+    int                 sw, sh, srw;
+    unsigned char       *dst;
+    int                 nw;
+    int                 nc;
+    int                 num, den;
+    int                 y0, y1;
+};
+
+// Find the source pixels s to e under output pixel i, and how much of the
+// first and last of them is covered. Returns the total coverage, which is
+// short at the right and bottom edges.
+static int
+ds_span(int i, int n, int num, int den, int *s, int *e, int *ws, int *we)
+{
+    int     lo = i * den;
+    int     hi = lo + den;
+
+    if (hi > n * num)
+        hi = n * num;
+    *s = lo / num;
+    *e = (hi - 1) / num;
+    if (*s == *e) {
+        *ws = *we = hi - lo;
+    } else {
+        *ws = (*s + 1) * num - lo;
+        *we = hi - *e * num;
+    }
+    return hi - lo;
+}
+
+// Average the rows of a strip. Whole number ratios take every pixel at the
+// same weight, so the rows are summed into 16 bit counts first.
+static void
+ds_rows(struct ds_job *j)
+{
+    unsigned short      *vs;
+    unsigned long long  *acc;
+    int                 *xs, *xe, *ws, *we, *tw;
+    int                 s, e, a, b, tv;
+    int                 x, y, r, k, c;
+    int                 nc = j->nc;
+    int                 sb = j->sw * nc;
+
+    xs = new int[j->nw * 5];
+    xe = xs + j->nw;
+    ws = xe + j->nw;
+    we = ws + j->nw;
+    tw = we + j->nw;
+    for (x = 0; x < j->nw; x++)
+        tw[x] = ds_span(x, j->sw, j->num, j->den, &xs[x], &xe[x],
+                        &ws[x], &we[x]);
+
+    if (j->num == 1 && j->den <= 257) {
+        vs = new unsigned short[sb + 16];
+        for (y = j->y0; y < j->y1; y++) {
+            unsigned char   *op = &j->dst[y * j->nw * nc];
+
+            tv = ds_span(y, j->sh, 1, j->den, &s, &e, &a, &b);
+            memset(vs, 0, sb * sizeof(unsigned short));
+            for (r = s; r <= e; r++) {
+                const unsigned char *sp = &j->src[r * j->srw];
+
+                x = 0;
+#ifdef __SSE2__
+                __m128i     z = _mm_setzero_si128();
+                for (; x + 16 <= sb; x += 16) {
+                    __m128i p = _mm_loadu_si128((const __m128i *)(sp + x));
+                    __m128i *vp = (__m128i *)(vs + x);
+                    _mm_storeu_si128(vp, _mm_add_epi16(_mm_loadu_si128(vp),
+                                     _mm_unpacklo_epi8(p, z)));
+                    _mm_storeu_si128(vp + 1,
+                                     _mm_add_epi16(_mm_loadu_si128(vp + 1),
+                                     _mm_unpackhi_epi8(p, z)));
+                }
+#endif
+                for (; x < sb; x++)
+                    vs[x] += sp[x];
+            }
+            for (x = 0; x < j->nw; x++) {
+                unsigned int    n = tw[x] * tv;
+
+                for (c = 0; c < nc; c++) {
+                    unsigned int    t = 0;
+
+                    for (k = xs[x]; k <= xe[x]; k++)
+                        t += vs[k * nc + c];
+                    *op++ = (t + n / 2) / n;
+                }
+            }
+        }
+        delete[] vs;
+    } else {
+        acc = new unsigned long long[j->nw * nc];
+        for (y = j->y0; y < j->y1; y++) {
+            unsigned char   *op = &j->dst[y * j->nw * nc];
+
+            tv = ds_span(y, j->sh, j->num, j->den, &s, &e, &a, &b);
+            memset(acc, 0, j->nw * nc * sizeof(unsigned long long));
+            for (r = s; r <= e; r++) {
+                const unsigned char *sp = &j->src[r * j->srw];
+                int                 wv = (r == s) ? a : (r == e) ? b : j->num;
+
+                for (x = 0; x < j->nw * nc; x++) {
+                    int             p = x / nc;
+                    const unsigned char *px = sp + (x - p * nc);
+                    unsigned int    h;
+
+                    if (xs[p] == xe[p]) {
+                        h = ws[p] * px[xs[p] * nc];
+                    } else {
+                        h = 0;
+                        for (k = xs[p] + 1; k < xe[p]; k++)
+                            h += px[k * nc];
+                        h = h * j->num + ws[p] * px[xs[p] * nc] +
+                            we[p] * px[xe[p] * nc];
+                    }
+                    acc[x] += (unsigned long long)wv * h;
+                }
+            }
+            for (x = 0; x < j->nw * nc; x++) {
+                unsigned long long n = (unsigned long long)tw[x / nc] * tv;
+                op[x] = (acc[x] + n / 2) / n;
+            }
+        }
+        delete[] acc;
+    }
+    delete[] xs;
+}
+
+static void *
+ds_run(void *arg)
+{
+    ds_rows((struct ds_job *)arg);
+    return NULL;
+}
+
+//
+// Reduce an image to target dots per inch by averaging the area under
+// each new pixel. The rows are split into strips, one for each processor.
+// Indexed images are expanded first. Gray images of less than 8 bits are
+// spread out to 8 bits to be averaged, and packed back to as many bits
+// after.
+void
+Image::downsample(int target)
+{
+    struct ds_job   *jobs;
+    pthread_t       *tid;
+    unsigned char   *nimage;
+    unsigned char   *dp;
+    int             num, den, g, t;
+    int             nw, nh;
+    int             n, k;
+    int             obpp, max;
+    long            i;
+
+    if (target <= 0 || target >= dpi)
+        return;
+    if (idat || dct) {
+        if (verbose)
+            fprintf(stderr, "    downsample skipped, image is not decoded\n");
+        return;
+    }
+    convert(0);
+    obpp = bpp;
+    max = (1 << bpp) - 1;
+    if (bpp != 8) {
+        nimage = new unsigned char[width * height];
+        for (k = 0; k < height; k++)
+            unpackrow(width, &data[k * row_width], &nimage[k * width]);
+        for (i = (long)width * height, dp = nimage; i > 0; i--, dp++)
+            *dp = (*dp * 255) / max;
+        delete[] data;
+        data = nimage;
+        bpp = 8;
+        row_width = width;
+    }
+    applyMap();
+    num = target;
+    den = dpi;
+    for (g = num, t = den; t != 0; ) {
+        int r = g % t;
+        g = t;
+        t = r;
+    }
+    num /= g;
+    den /= g;
+    nw = (width * num + den - 1) / den;
+    nh = (height * num + den - 1) / den;
+    if (verbose)
+        fprintf(stderr, "    downsample %d -> %d dpi %dx%d\n", dpi, target,
+                        nw, nh);
+    nimage = new unsigned char[nw * nh * colors];
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 16)
+        n = 16;
+    if (n > nh / 32)
+        n = nh / 32;
+    if (n < 1)
+        n = 1;
+    jobs = new struct ds_job[n];
+    tid = new pthread_t[n];
+    for (k = 0; k < n; k++) {
+        jobs[k].src = data;
+        jobs[k].sw = width;
+        jobs[k].sh = height;
+        jobs[k].srw = row_width;
+        jobs[k].dst = nimage;
+        jobs[k].nw = nw;
+        jobs[k].nc = colors;
+        jobs[k].num = num;
+        jobs[k].den = den;
+        jobs[k].y0 = (nh * k) / n;
+        jobs[k].y1 = (nh * (k + 1)) / n;
+    }
+    // Strips that can't get a thread are done here instead.
+    for (k = 1; k < n; k++) {
+        if (pthread_create(&tid[k], NULL, ds_run, &jobs[k]) != 0) {
+            ds_rows(&jobs[k]);
+            jobs[k].y1 = -1;
+        }
+    }
+    ds_rows(&jobs[0]);
+    for (k = 1; k < n; k++) {
+        if (jobs[k].y1 >= 0)
+            pthread_join(tid[k], NULL);
+    }
+    delete[] tid;
+    delete[] jobs;
+    delete[] data;
+    data = nimage;
+    width = nw;
+    height = nh;
+    row_width = nw * colors;
+    dpi = target;
+    hist_ok = 0;
+    if (obpp != 8) {
+        // Nearest of the levels there were before, packed in place.
+        for (i = (long)nw * nh, dp = data; i > 0; i--, dp++)
+            *dp = (*dp * max + 127) / 255;
+        bpp = obpp;
+        row_width = (nw * bpp + 7) / 8;
+        for (k = 0; k < nh; k++)
+            packrow(nw, &data[k * nw], &data[k * row_width]);
+    }
+}
+
+// Signed size of a filtered byte, used to pick the best predictor.
+static inline int
+pred_mag(unsigned char v)
+{
+    return (v < 128) ? v : 256 - v;
+}
+
+// Paeth predictor from the PNG spec.
+static inline int
+paeth(int a, int b, int c)
+{
+    int     pa = abs(b - c);
+    int     pb = abs(a - c);
+    int     pc = abs(a + b - 2 * c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+#ifdef __SSE2__
+// Add the signed sizes of 16 filtered bytes to a sum.
+static inline __m128i
+mag_sum(__m128i acc, __m128i v)
+{
+    __m128i     z = _mm_setzero_si128();
+
+    v = _mm_min_epu8(v, _mm_sub_epi8(z, v));
+    return _mm_add_epi64(acc, _mm_sad_epu8(v, z));
+}
+
+static inline int
+sum_of(__m128i acc)
+{
+    return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+}
+
+// Paeth predictor for 8 pixels held as 16 bit values.
+static inline __m128i
+paeth8(__m128i a, __m128i b, __m128i c)
+{
+    __m128i     z = _mm_setzero_si128();
+    __m128i     bc = _mm_sub_epi16(b, c);
+    __m128i     ac = _mm_sub_epi16(a, c);
+    __m128i     pa = _mm_max_epi16(bc, _mm_sub_epi16(z, bc));
+    __m128i     pb = _mm_max_epi16(ac, _mm_sub_epi16(z, ac));
+    __m128i     pc = _mm_add_epi16(bc, ac);
+    __m128i     ma, mb;
+
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(z, pc));
+    ma = _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi16(pa, pb),
+                                       _mm_cmpgt_epi16(pa, pc)),
+                          _mm_set1_epi16(-1));
+    mb = _mm_andnot_si128(ma, _mm_andnot_si128(_mm_cmpgt_epi16(pb, pc),
+                                               _mm_set1_epi16(-1)));
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(ma, a),
+                                     _mm_and_si128(mb, b)),
+                        _mm_andnot_si128(_mm_or_si128(ma, mb), c));
+}
+#endif
+
+// Filter byte x of a row, n bytes past the pixel to its left.
+static inline void
+filter_byte(const unsigned char *sp, const unsigned char *up, int rw, int n,
+            int x, unsigned char *cand, int *sum)
+{
+    int             v = sp[x];
+    int             a = (x >= n) ? sp[x - n] : 0;
+    int             b = up[x];
+    int             c = (x >= n) ? up[x - n] : 0;
+
+    cand[x] = v - a;
+    cand[rw + x] = v - b;
+    cand[2 * rw + x] = v - ((a + b) >> 1);
+    cand[3 * rw + x] = v - paeth(a, b, c);
+    sum[0] += pred_mag(v);
+    sum[1] += pred_mag(cand[x]);
+    sum[2] += pred_mag(cand[rw + x]);
+    sum[3] += pred_mag(cand[2 * rw + x]);
+    sum[4] += pred_mag(cand[3 * rw + x]);
+}
+
+// Run the Sub, Up, Average and Paeth filters over a row of rw bytes with
+// n bytes per pixel, up is the row above. The results go into the four
+// rows of cand, and sum gets the size of each filter, starting with None.
+static void
+filter_row(const unsigned char *sp, const unsigned char *up, int rw, int n,
+           unsigned char *cand, int *sum)
+{
+    int             x, i;
+
+    for (i = 0; i < 5; i++)
+        sum[i] = 0;
+    x = 0;
+#ifdef __SSE2__
+    if (rw > 16 + n) {
+        __m128i     s0, s1, s2, s3, s4;
+        __m128i     z = _mm_setzero_si128();
+        __m128i     one = _mm_set1_epi8(1);
+
+        for (; x < n; x++)
+            filter_byte(sp, up, rw, n, x, cand, sum);
+        s0 = s1 = s2 = s3 = s4 = z;
+        for (; x + 16 <= rw; x += 16) {
+            __m128i vv = _mm_loadu_si128((const __m128i *)(sp + x));
+            __m128i va = _mm_loadu_si128((const __m128i *)(sp + x - n));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(up + x));
+            __m128i vc = _mm_loadu_si128((const __m128i *)(up + x - n));
+            __m128i f, p;
+
+            s0 = mag_sum(s0, vv);
+            f = _mm_sub_epi8(vv, va);
+            _mm_storeu_si128((__m128i *)(cand + x), f);
+            s1 = mag_sum(s1, f);
+            f = _mm_sub_epi8(vv, vb);
+            _mm_storeu_si128((__m128i *)(cand + rw + x), f);
+            s2 = mag_sum(s2, f);
+            // Floor of the average, avg_epu8 rounds up.
+            p = _mm_sub_epi8(_mm_avg_epu8(va, vb),
+                             _mm_and_si128(_mm_xor_si128(va, vb), one));
+            f = _mm_sub_epi8(vv, p);
+            _mm_storeu_si128((__m128i *)(cand + 2 * rw + x), f);
+            s3 = mag_sum(s3, f);
+            p = _mm_packus_epi16(
+                    paeth8(_mm_unpacklo_epi8(va, z), _mm_unpacklo_epi8(vb, z),
+                           _mm_unpacklo_epi8(vc, z)),
+                    paeth8(_mm_unpackhi_epi8(va, z), _mm_unpackhi_epi8(vb, z),
+                           _mm_unpackhi_epi8(vc, z)));
+            f = _mm_sub_epi8(vv, p);
+            _mm_storeu_si128((__m128i *)(cand + 3 * rw + x), f);
+            s4 = mag_sum(s4, f);
+        }
+        sum[0] += sum_of(s0);
+        sum[1] += sum_of(s1);
+        sum[2] += sum_of(s2);
+        sum[3] += sum_of(s3);
+        sum[4] += sum_of(s4);
+    }
+#endif
+    for (; x < rw; x++)
+        filter_byte(sp, up, rw, n, x, cand, sum);
+}
+
+// Apply PNG predictors to rows of rw bytes with n bytes per pixel. Each
+// row takes the filter with the smallest sum of signed bytes, as libpng
+// does, and is written with the filter type in front. Returns a new buffer
+// of (rw + 1) * height bytes, and the count of each byte value in it in
+// hist.
+static unsigned char *
+png_predict(const unsigned char *data, int rw, int n, int height,
+            unsigned long int *hist)
+{
+    unsigned char   *out, *op;
+    unsigned char   *cand;
+    unsigned char   *zero;
+    const unsigned char *sp, *up;
+    int             sum[5];
+    int             best;
+    int             i, j;
+
+    out = new unsigned char[(rw + 1) * height];
+    cand = new unsigned char[4 * rw];
+    zero = new unsigned char[rw];
+    memset(zero, 0, rw);
+    memset(hist, 0, 256 * sizeof(*hist));
+    op = out;
+    for (j = 0; j < height; j++) {
+        sp = &data[j * rw];
+        up = (j == 0) ? zero : sp - rw;
+        filter_row(sp, up, rw, n, cand, sum);
+        best = 0;
+        for (i = 1; i < 5; i++) {
+            if (sum[i] < sum[best])
+                best = i;
+        }
+        hist[best]++;
+        *op++ = best;
+        memcpy(op, (best == 0) ? sp : &cand[(best - 1) * rw], rw);
+        for (i = 0; i < rw; i++)
+            hist[*op++]++;
+    }
+    delete[] cand;
+    delete[] zero;
+    return out;
+}
+
+// Number of bits needed to code n bytes with the counts in hist, if each
+// byte was coded on its own.
+static double
+est_bits(const unsigned long int *hist, unsigned long int n)
+{
+    double          bits = 0.0;
+    int             i;
+
+    for (i = 0; i < 256; i++) {
+        if (hist[i] != 0)
+            bits -= hist[i] * log2((double)hist[i] / (double)n);
+    }
+    return bits;
+}
+
+// Compress len bytes of buf onto the stream if that comes out smaller
+// than limit. Returns 1 if the data was added.
+static int
+flate(Stream *strm, const unsigned char *buf, unsigned int len,
+      unsigned int limit, int level, int strategy)
+{
+    z_stream        zs;
+    unsigned int    zlen = compressBound(len);
+    Bytef           *zbuf = new Bytef[zlen];
+    int             r = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.next_in = (Bytef *)buf;
+    zs.avail_in = len;
+    zs.next_out = zbuf;
+    zs.avail_out = zlen;
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15, 8, strategy) == Z_OK) {
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < limit) {
+            strm->appendData((char *)zbuf, zs.total_out);
+            strm->encoded("/Filter/FlateDecode");
+            r = 1;
+        }
+        deflateEnd(&zs);
+    }
+    delete[] zbuf;
+    return r;
 }
 
 //
@@ -222,16 +1425,174 @@ Image::thresh(int value)
 Obj
 *Image::save(Stream *strm)
 {
-    strm->appendData((char *)data, row_width * height);
+    return save(strm, encode(strm));
+}
+
+//
+// Put the data of the image on the Stream, without writing anything.
+// Black and white images are sent as JBIG2, as text made of the symbols
+// in syms when it is given and the image has any. Group 4 is only tried
+// when that is no smaller than the raw bits, and is kept if it is. Gray
+// and RGB images go through the PNG predictors before Flate when that
+// looks like it will help. Noisy scans often do better without them.
+// Indexed images keep their packed indices and carry the palette in the
+// color space. Returns how it was encoded, for save.
+int
+Image::encode(Stream *strm, JBIG2Syms *syms)
+{
+    CCITT           fax;
+    JBIG2           jb;
+    unsigned char   *pred;
+    unsigned long int phist[256];
+    unsigned int    raw;
+    int             done = 0;
+    int             g4 = 0;
+    int             png = 0;
+    int             text = 0;
+
+    applyMap();
+    raw = row_width * height;
+    if (dct != 0) {
+        strm->appendData((char *)data, dct);
+        strm->encoded("/Filter/DCTDecode");
+        done = 1;
+    } else if (idat != 0) {
+        strm->appendData((char *)data, idat);
+        strm->encoded("/Filter/FlateDecode");
+        done = png = 1;
+    } else if (bpp == 1 && palette == 0) {
+        if (syms != 0)
+            text = jb.encode(data, width, height, row_width, syms);
+        if (!text)
+            jb.encode(data, width, height, row_width);
+        if (jb.len < raw) {
+            strm->appendData((char *)jb.out, jb.len);
+            strm->encoded("/Filter/JBIG2Decode");
+            done = 1;
+        } else {
+            // Left for images JBIG2 does not suit at all.
+            text = 0;
+            fax.encode(data, width, height, row_width);
+            if (fax.len < raw) {
+                strm->appendData((char *)fax.out, fax.len);
+                strm->encoded("/Filter/CCITTFaxDecode");
+                done = g4 = 1;
+            }
+        }
+    } else if (bpp == 8 && palette == 0) {
+        count();
+        pred = png_predict(data, row_width, colors, height, phist);
+        // Filtered rows are mostly runs of small values. Z_RLE gets them
+        // as small as the full search does, in a fraction of the time.
+        // RGB repeats every three bytes, which runs don't find.
+        if (est_bits(phist, raw + height) < est_bits(hist, raw))
+            done = png = flate(strm, pred, raw + height, raw,
+                               (colors == 1) ? Z_BEST_COMPRESSION :
+                                               Z_DEFAULT_COMPRESSION,
+                               (colors == 1) ? Z_RLE : Z_FILTERED);
+        delete[] pred;
+    }
+    if (!done)
+        strm->appendData((char *)data, raw);
+    return (g4 ? ENC_G4 : 0) | (png ? ENC_PNG : 0) | (text ? ENC_SYMS : 0);
+}
+
+//
+// Write the image with the data encode put on the Stream. Text refers to
+// the JBIG2Globals of syms.
+Obj
+*Image::save(Stream *strm, int how, JBIG2Syms *syms)
+{
     strm->open("XObject/Subtype/Image");
     strm->put("Width", width);
     strm->put("Height", height);
-    strm->put("\n/ColorSpace/DeviceGray");
+    if (palette != 0) {
+        char    cs[40 + 6 * 256];
+        char    *p;
+        int     i;
+
+        p = cs + sprintf(cs, "\n/ColorSpace[/Indexed/DeviceRGB %d<",
+                         pal_size - 1);
+        for (i = 0; i < 3 * pal_size; i++)
+            p += sprintf(p, "%02X", palette[i]);
+        strcpy(p, ">]");
+        strm->put(cs);
+    } else
+        strm->put((colors == 3) ? "\n/ColorSpace/DeviceRGB" :
+                                  "\n/ColorSpace/DeviceGray");
     strm->put("BitsPerComponent", bpp);
+    if (how & ENC_G4) {
+        strm->put("\n/DecodeParms<<");
+        strm->put("K", -1);
+        strm->put("Columns", width);
+        strm->put("Rows", height);
+        strm->put(">>");
+    }
+    if (how & ENC_SYMS) {
+        strm->put("\n/DecodeParms<<");
+        syms->obj->ref("JBIG2Globals");
+        strm->put(">>");
+    }
+    if (how & ENC_PNG) {
+        strm->put("\n/DecodeParms<<");
+        strm->put("Predictor", 15);
+        if (colors != 1)
+            strm->put("Colors", colors);
+        if (bpp != 8)
+            strm->put("BitsPerComponent", bpp);
+        strm->put("Columns", width);
+        strm->put(">>");
+    }
     strm->close();
     return strm->obj;
 }
 
+// Mix n bytes of p into the hash h, a word at a time.
+uint64_t
+Image::hashBytes(uint64_t h, const void *d, unsigned long n)
+{
+    const unsigned char *p = (const unsigned char *)d;
+    uint64_t        w;
+
+    h ^= n;
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    for (w = 0; n > 0; n--)
+        w = (w << 8) | *p++;
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 32);
+}
+
+//
+// Hash of the image as save would write it, so images that come out the
+// same can share one XObject.
+uint64_t
+Image::hash()
+{
+    int             hdr[7];
+    uint64_t        h;
+
+    applyMap();
+    hdr[0] = width;
+    hdr[1] = height;
+    hdr[2] = bpp;
+    hdr[3] = colors;
+    hdr[4] = idat;
+    hdr[5] = dct;
+    hdr[6] = pal_size;
+    h = hashBytes(0, hdr, sizeof(hdr));
+    if (palette != 0)
+        h = hashBytes(h, palette, 3 * pal_size);
+    if (dct != 0)
+        return hashBytes(h, data, dct);
+    if (idat != 0)
+        return hashBytes(h, data, idat);
+    return hashBytes(h, data, (unsigned long)row_width * height);
+}
+
 // Explode row into array of pixels.
 void
 Image::unpackrow(int width, unsigned char *in, unsigned char *out)
@@ -251,7 +1612,7 @@ Image::unpackrow(int width, unsigned char *in, unsigned char *out)
    for (i = 0; i < width; i++) {
         k -= bpp;
         *out++ = (cur >> k) & mask;
-        if (k == 0) {
+        if (k == 0 && (i + 1) < width) {
             k = 8;
             cur = *in++;
        }
@@ -286,7 +1647,7 @@ Image::packrow(int width, unsigned char *in, unsigned char *out)
         }
     }
     if (k != 7) {
-        while(k > 0) {
+        while(k >= 0) {
             cur <<= bpp;
             k -= bpp;
         }
@@ -294,13 +1655,46 @@ Image::packrow(int width, unsigned char *in, unsigned char *out)
     }
 }
 
+//
+// Combine two geometric transforms, op is done after xf.
+// A transform is kept as a transpose, then a row reverse, then a flip.
+// Transposing after a reverse is the same as a flip after the transpose,
+// so a transpose in op swaps the reverse and flip already in xf.
+int
+Image::compose(int xf, int op)
+{
+    if (op & XF_TRANSPOSE) {
+        xf = ((xf ^ XF_TRANSPOSE) & ~(XF_REVERSE|XF_FLIP)) |
+             ((xf & XF_REVERSE) ? XF_FLIP : 0) |
+             ((xf & XF_FLIP) ? XF_REVERSE : 0);
+    }
+    return xf ^ (op & (XF_REVERSE|XF_FLIP));
+}
+
+//
+// Apply a geometric transform in a single pass over the image.
+void
+Image::remap(int xf)
+{
+    int     rx = (xf & XF_REVERSE) != 0;
+    int     ry = (xf & XF_FLIP) != 0;
+
+    if (xf & XF_TRANSPOSE) {
+        if (bpp == 1)
+            transpose1(rx, ry);
+        else
+            transposeN(rx, ry);
+    } else if (rx || ry) {
+        mirror(rx, ry);
+    }
+}
+
 //
 // Basic image rotation, right 90 degrees.
 void
 Image::rotater90()
 {
-    transpose();
-    reverse();
+    remap(XF_CW);
 }
 
 //
@@ -308,16 +1702,14 @@ Image::rotater90()
 void
 Image::rotatel90()
 {
-   transpose();
-   flip();
+    remap(XF_CCW);
 }
 
 // Basic image rotation, 180 degrees.
 void
 Image::rotate180()
 {
-   flip();
-   reverse();
+    remap(XF_ROTATE);
 }
 
 // Flip an image by 90 degrees.
@@ -325,72 +1717,308 @@ Image::rotate180()
 void
 Image::transpose()
 {
-    int             i, j;
-    unsigned char   row_buffer[width];
-    unsigned char   *dp;
+    remap(XF_TRANSPOSE);
+}
+
+// Row reverse and image.
+void
+Image::reverse()
+{
+    remap(XF_REVERSE);
+}
+
+// flip image up side down.
+void
+Image::flip()
+{
+    remap(XF_FLIP);
+}
+
+// Transpose an image of 2, 4 or 8 bits, or RGB, mirroring the result.
+// Mirroring is done by walking the source rows or the new rows backwards.
+void
+Image::transposeN(int rx, int ry)
+{
+    int             i;
+    int             nrw;
+    int             ss, ds;
+    unsigned char   *sp, *dp;
+    unsigned char   *temp;
+
+    nrw = ((height * bpp * colors) + 7) / 8;
+    if (bpp != 8) {
+        transposeP(rx, ry, nrw);
+        return;
+    }
+    sp = data;
+    ss = row_width;
+    ds = nrw;
+    temp = new unsigned char[ds * width];
+    dp = temp;
+    // Reverse makes new column x come from old row height-1-x.
+    if (rx) {
+        sp += (height - 1) * ss;
+        ss = -ss;
+    }
+    // Flip makes new row y come from old column width-1-y.
+    if (ry) {
+        dp += (width - 1) * ds;
+        ds = -ds;
+    }
+    if (colors == 3) {
+        int     x, y;
+
+        // Color pixels are moved whole, one at a time.
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++)
+                memcpy(&dp[x * ds + y * 3], &sp[y * ss + x * 3], 3);
+        }
+    } else
+        transpose_bytes(sp, ss, dp, ds, width, height);
+    delete[] data;
+    data = temp;
+    i = height;
+    height = width;
+    width = i;
+    row_width = nrw;
+}
+
+// Transpose a packed 2 or 4 bit image, mirroring the result. It is done
+// a strip of STRIP columns at a time, only the strip is exploded to a
+// byte per pixel, so the image is never held unpacked.
+#define STRIP   64
+void
+Image::transposeP(int rx, int ry, int nrw)
+{
     unsigned char   *temp;
+    unsigned char   *strip;
     unsigned char   *tp;
+    int             x, n, i, y;
 
-    dp = data;
-    temp = new unsigned char[width * height];
-    for(i = 0; i < height; i++) {
-        unpackrow(width, dp, row_buffer);
-        tp = &temp[i];
-        for (j = 0; j < width; j++) {
-            *tp = row_buffer[j];
-             tp += height;
+    temp = new unsigned char[nrw * width];
+    strip = new unsigned char[STRIP * height];
+    tp = new unsigned char[STRIP * height];
+    for (x = 0; x < width; x += STRIP) {
+        n = width - x;
+        if (n > STRIP)
+            n = STRIP;
+        // Strips start on a byte, as STRIP pixels fill whole bytes.
+        for (i = 0; i < height; i++) {
+            y = (rx) ? height - 1 - i : i;
+            unpackrow(n, &data[i * row_width + (x * bpp) / 8],
+                      &strip[y * STRIP]);
+        }
+        transpose_bytes(strip, STRIP, tp, height, n, height);
+        for (i = 0; i < n; i++) {
+            y = (ry) ? width - 1 - (x + i) : x + i;
+            packrow(height, &tp[i * height], &temp[y * nrw]);
         }
-        dp += row_width;
     }
+    delete[] strip;
+    delete[] tp;
+    delete[] data;
+    data = temp;
     i = height;
     height = width;
     width = i;
-    row_width = (width * bpp) / 8;
-    if ((row_width * bpp) < width)
-        row_width++;
-    dp = data;
-    tp = temp;
-    for(i = 0; i < height; i++) {
-        packrow(width, tp, dp);
-        dp += row_width;
-        tp += width;
+    row_width = nrw;
+}
+
+// Transpose a 1 bit image without exploding it, mirroring the result.
+// The image is cut into blocks of 64 rows by 64 columns, each block is
+// gathered into 64 words, transposed as a bit matrix and scattered to the
+// new image. Pixels off the edge of the image read as zero.
+void
+Image::transpose1(int rx, int ry)
+{
+    int             nrw;
+    int             bx, by, i, k;
+    int             rows, cols;
+    int             orows, ocols;
+    int             ds;
+    unsigned char   *temp;
+    unsigned char   *sp;
+    unsigned char   *tp;
+    uint64_t        a[64];
+    uint64_t        x;
+
+    nrw = (height + 7) / 8;
+    temp = new unsigned char[nrw * width];
+    // Flip walks the new rows from the bottom up.
+    ds = (ry) ? -nrw : nrw;
+    for (by = 0; by < height; by += 64) {
+        rows = (height - by < 64) ? (height - by) : 64;
+        for (bx = 0; bx < row_width; bx += 8) {
+            // Gather up to 64 rows of 8 bytes, reverse takes them
+            // from the bottom of the image up.
+            cols = (row_width - bx < 8) ? (row_width - bx) : 8;
+            for (i = 0; i < rows; i++) {
+                sp = &data[(((rx) ? (height - 1 - by - i) : (by + i)) *
+                             row_width) + bx];
+                if (cols == 8) {
+                    x = ((uint64_t)sp[0] << 56) | ((uint64_t)sp[1] << 48) |
+                        ((uint64_t)sp[2] << 40) | ((uint64_t)sp[3] << 32) |
+                        ((uint64_t)sp[4] << 24) | ((uint64_t)sp[5] << 16) |
+                        ((uint64_t)sp[6] << 8) | (uint64_t)sp[7];
+                } else {
+                    for (x = 0, k = 0; k < 8; k++)
+                        x = (x << 8) | ((k < cols) ? sp[k] : 0);
+                }
+                a[i] = x;
+            }
+            for (; i < 64; i++)
+                a[i] = 0;
+            transpose64(a);
+            // Row i of the block is column (bx * 8) + i of the image.
+            orows = (width - (bx * 8) < 64) ? (width - (bx * 8)) : 64;
+            ocols = (nrw - (by / 8) < 8) ? (nrw - (by / 8)) : 8;
+            k = bx * 8;
+            tp = &temp[(((ry) ? (width - 1 - k) : k) * nrw) + (by / 8)];
+            for (i = 0; i < orows; i++) {
+                x = a[i];
+                if (ocols == 8) {
+                    tp[0] = (unsigned char)(x >> 56);
+                    tp[1] = (unsigned char)(x >> 48);
+                    tp[2] = (unsigned char)(x >> 40);
+                    tp[3] = (unsigned char)(x >> 32);
+                    tp[4] = (unsigned char)(x >> 24);
+                    tp[5] = (unsigned char)(x >> 16);
+                    tp[6] = (unsigned char)(x >> 8);
+                    tp[7] = (unsigned char)x;
+                } else {
+                    for (k = 0; k < ocols; k++)
+                        tp[k] = (unsigned char)(x >> (56 - (k * 8)));
+                }
+                tp += ds;
+            }
+        }
     }
-    delete[] temp;
+    delete[] data;
+    data = temp;
+    i = height;
+    height = width;
+    width = i;
+    row_width = nrw;
 }
 
-// Row reverse and image.
+// Reverse a packed 1 bit row of rw bytes with pad unused bits at the end.
+// Rows are handled 64 bits at a time, each word is bit reversed end for
+// end and shifted left to drop the padding bits that moved to the front of
+// the row. Leftover bytes go through a bit reversal table.
+static void
+reverse_bits(const unsigned char *in, unsigned char *out, int rw, int pad)
+{
+    int                 j;
+    const unsigned char *sp;
+    uint64_t            x;
+    unsigned int        cur;
+
+    if (!rev_init)
+        init_rev_byte();
+    for (j = 0; j + 8 <= rw; j += 8) {
+        sp = &in[rw - j - 8];
+        x = ((uint64_t)sp[0] << 56) | ((uint64_t)sp[1] << 48) |
+            ((uint64_t)sp[2] << 40) | ((uint64_t)sp[3] << 32) |
+            ((uint64_t)sp[4] << 24) | ((uint64_t)sp[5] << 16) |
+            ((uint64_t)sp[6] << 8) | (uint64_t)sp[7];
+        x = rev64(x);
+        if (pad != 0 && sp != in)
+            x = (x << pad) | (rev_byte[sp[-1]] >> (8 - pad));
+        else if (pad != 0)
+            x <<= pad;
+        out[j] = (unsigned char)(x >> 56);
+        out[j + 1] = (unsigned char)(x >> 48);
+        out[j + 2] = (unsigned char)(x >> 40);
+        out[j + 3] = (unsigned char)(x >> 32);
+        out[j + 4] = (unsigned char)(x >> 24);
+        out[j + 5] = (unsigned char)(x >> 16);
+        out[j + 6] = (unsigned char)(x >> 8);
+        out[j + 7] = (unsigned char)x;
+    }
+    for (; j < rw; j++) {
+        cur = rev_byte[in[rw - 1 - j]] << 8;
+        if (j + 1 < rw)
+            cur |= rev_byte[in[rw - 2 - j]];
+        out[j] = (unsigned char)(cur >> (8 - pad));
+    }
+}
+
+// Copy a row into out with its pixels in reverse order.
 void
-Image::reverse()
+Image::reverserow(unsigned char *in, unsigned char *out)
 {
-    int             i, j, k;
+    int             i;
     unsigned char   row_buffer[width];
-    unsigned char   *dp;
 
-    dp = data;
-    for(i = 0; i < height; i++) {
-        unpackrow(width, dp, row_buffer);
-        for (j = 0, k = width-1; j < k; j++, k--) {
+    if (colors == 3) {
+        for (i = 0; i < width; i++)
+            memcpy(&out[3 * i], &in[3 * (width - 1 - i)], 3);
+        return;
+    }
+    switch (bpp) {
+    case 1:
+        reverse_bits(in, out, row_width, (row_width * 8) - width);
+        break;
+    case 8:
+        i = 0;
+#ifdef __SSE2__
+        // Reverse 16 bytes at a time, by dwords, words then bytes.
+        for (; i + 16 <= width; i += 16) {
+            __m128i     v;
+
+            v = _mm_loadu_si128((const __m128i *)&in[width - 16 - i]);
+            v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i *)&out[i], v);
+        }
+#endif
+        for (; i < width; i++)
+            out[i] = in[width - 1 - i];
+        break;
+    default:
+        unpackrow(width, in, row_buffer);
+        for (i = 0; i < width / 2; i++) {
             unsigned char    t;
-            t = row_buffer[j];
-            row_buffer[j] = row_buffer[k];
-            row_buffer[k] = t;
+            t = row_buffer[i];
+            row_buffer[i] = row_buffer[width - 1 - i];
+            row_buffer[width - 1 - i] = t;
         }
-        packrow(width, row_buffer, dp);
-        dp += row_width;
+        packrow(width, row_buffer, out);
+        break;
     }
 }
 
-// flip image up side down.
+// Reverse and or flip an image in place.
+// Rows are swapped top for bottom, being reversed on the way.
 void
-Image::flip()
+Image::mirror(int rx, int ry)
 {
     int             i, j;
     unsigned char   row_buffer[row_width];
+    unsigned char   *top, *bot;
 
-    for(i = 0, j = height-1; i < j; i++, j--) {
-        memcpy(row_buffer, &data[i * row_width], row_width);
-        memcpy(&data[i * row_width], &data[j * row_width], row_width);
-        memcpy(&data[j * row_width], row_buffer, row_width);
+    if (!ry) {
+        for (i = 0; i < height; i++) {
+            top = &data[i * row_width];
+            memcpy(row_buffer, top, row_width);
+            reverserow(row_buffer, top);
+        }
+        return;
+    }
+    for(i = 0, j = height-1; i <= j; i++, j--) {
+        top = &data[i * row_width];
+        bot = &data[j * row_width];
+        memcpy(row_buffer, top, row_width);
+        if (rx) {
+            if (i != j)
+                reverserow(bot, top);
+            reverserow(row_buffer, bot);
+        } else if (i != j) {
+            memcpy(top, bot, row_width);
+            memcpy(bot, row_buffer, row_width);
+        }
     }
 }
 
@@ -403,13 +2031,13 @@ Image::unsharp(int amount, int radius, int thresh)
     unsigned char   *tp;
     int             i, j, k;
     int             acc;
-    int             min = 128;
-    int             max = 128;
-    unsigned char   map[256];
-    float           scale;
 
+    convert(1);
+    if (bpp != 8) 
+        return;
     if (verbose)
         fprintf(stderr, "    unsharp %d %d %d\n", amount, radius, thresh);
+    applyMap();
     temp = new unsigned char [width * height];
     temp2 = new unsigned char [width * height];
     dp = data;
@@ -521,32 +2149,8 @@ Image::unsharp(int amount, int radius, int thresh)
             tp++;
          }
     }
-    for (i = 0; i < 128; i++) {
-        if (hist[i] != 0) {
-            min = i;
-            break;
-       }
-    }
-    for (i = 255; i > 128; i--) {
-        if (hist[i] != 0) {
-             max = i;
-             break;
-        }
-    }
-    scale = 256.0 / ((float)(max - min));
-    for (i = 0; i < 256; i++) {
-        int k = (int)(((float)(i - min))*scale);
-        if (k < 0)
-            k = 0;
-        if (k > 255)
-            k = 255;
-        map[i] = k;
-    }
-
-    memset(hist, 0, sizeof(hist));
-    dp = data;
-    for (i = row_width * height; i > 0; i--, dp++) 
-         hist[(int)(*dp = map[(int)*dp])]++;
+    hist_ok = 1;
+    normalize();
     delete[] temp;
     delete[] temp2;
 }
@@ -555,13 +2159,12 @@ Image::unsharp(int amount, int radius, int thresh)
 void
 Image::contrast(int angle, int bright)
 {
-    unsigned char map[256];
+    unsigned char m[256];
     float         tan_angle;
     float         tan_range;
-    unsigned char    *dp;
     int           i;
 
-    if (bpp != 8)
+    if (bpp != 8 && palette == 0)
         return;
     tan_angle = tan(((float)(angle)) * (M_PI/180.0));
     tan_range = 128.0 * tan_angle;
@@ -570,53 +2173,59 @@ Image::contrast(int angle, int bright)
     for (i = 0; i < 256; i++) {
          int t;
          if (i < (int)(128.0 + tan_range) && i > (int)(128.0-tan_range))
-               map[i] = 128 + (int)((float)(i-128)/tan_angle);
+               m[i] = 128 + (int)((float)(i-128)/tan_angle);
          else if (i >= (int)(128.0 + tan_range))
-               map[i] = 255;
+               m[i] = 255;
          else
-               map[i] = 0;
-         t = map[i] + bright;
+               m[i] = 0;
+         t = m[i] + bright;
          if (t > 255)
              t = 255;
          else if (t < 0)
              t = 0;
-         map[i] = t;
+         m[i] = t;
     }
-         
-    dp = data;
-    memset(hist, 0, sizeof(hist));
-    for (i = row_width * height; i > 0; i--, dp++) 
-         hist[(int)(*dp = map[(int)*dp])]++;
+    addMap(m);
 }
 
 // Create border around image.
+// Packed 1 bit images are scanned in place, other depths are exploded
+// one row at a time.
 void
 Image::boardFill()
 {
-    int             i, j, k;
+    int             i, j, k, l;
     unsigned char   row_buffer[width];
     unsigned char   finished[width + 1];
-    unsigned char   *dp = data;
+    unsigned char   *dp;
+    unsigned char   *row;
     int             max;    // max value to replace.
     int             pix;    // replacement pixel
 
+    convert(1);
+    applyMap();
+    hist_ok = 0;
+    dp = data;
     pix = (1 << bpp) - 1;
     max = pix >> 1;
+    row = row_buffer;
     memset(finished, 0, width);
     // Scan from top down 
     for (i = 0; i< height ; i++) {
         // Explode row 
-        unpackrow(width, dp, row_buffer);
+        if (bpp == 1)
+            row = dp;
+        else
+            unpackrow(width, dp, row_buffer);
         // Scan toward center 
         for (j = 0; j < width/2; j++) {
-            if (row_buffer[j] <= max) {
-                row_buffer[j] = pix;
+            if (getpix(row, j) <= max) {
+                setpix(row, j, pix);
                 finished[j+1] = 0;  // Check next one over
             } else {
-                int l;
                 // Check next 10 pixels
                 for (l = 0; l < 10; l++) 
-                    if (row_buffer[j+l] <= max)
+                    if (getpix(row, j+l) <= max)
                        break;
                 if (l == 10)        // Nothing to do, done with row.
                     break;
@@ -626,15 +2235,14 @@ Image::boardFill()
         if (j == 0) // Stop at 1 on back scan
             j++;
         // Back scan to where we finished.
-        for (k = width-1; k > j && row_buffer[k] <= max; k++) {
-            if (row_buffer[j] <= max) {
-                row_buffer[j] = pix;
+        for (k = width-1; k > j; k--) {
+            if (getpix(row, k) <= max) {
+                setpix(row, k, pix);
                 finished[k-1] = 0;  // Check next one over
             } else {
-                int l;
                 // Check next 10 pixels
-                for (l = 0; l < 10; l++) 
-                    if (row_buffer[k-l] <= max)
+                for (l = 0; l < 10 && l < k; l++) 
+                    if (getpix(row, k-l) <= max)
                        break;
                 if (l == 10)        // Nothing to do, done with row.
                     break;
@@ -644,14 +2252,15 @@ Image::boardFill()
         for (; j < k; j++) {
             // Stop after we have not found anything in 10 rows.
             if (finished[j] < 10) {
-               if (row_buffer[j] <= max) 
-                  row_buffer[j] = pix;
+               if (getpix(row, j) <= max) 
+                  setpix(row, j, pix);
                else
                   finished[j]++;
             }
         }
         // Put it back.
-        packrow(width, row_buffer, dp);
+        if (bpp != 1)
+            packrow(width, row_buffer, dp);
         dp += row_width;
     }
     memset(finished, 0, width);     // Reset finished arrary
@@ -660,26 +2269,29 @@ Image::boardFill()
         int did = 0;
         dp -= row_width;
         // Explode row 
-        unpackrow(width, dp, row_buffer);
+        if (bpp == 1)
+            row = dp;
+        else
+            unpackrow(width, dp, row_buffer);
         // Scan toward center 
-        for (j = 0; j < width && row_buffer[j] <= max; j++) {
-            row_buffer[j] = pix;
+        for (j = 0; j < width && getpix(row, j) <= max; j++) {
+            setpix(row, j, pix);
             finished[j+1] = 0;      // Check next one over
             did++;
         }
         if (j == 0) // Stop at 1 on back scan
             j++;
         // Back scan to where we finished.
-        for (k = width-1; k > j && row_buffer[k] <= max; k++) {
-            row_buffer[k] = pix;
+        for (k = width-1; k > j && getpix(row, k) <= max; k--) {
+            setpix(row, k, pix);
             finished[k-1] = 0;      // Check previous one
             did++;
         }
         // Scan top 
         for (; j < k; j++) {
             if (finished[j] < 10) {
-               if (row_buffer[j] <= max) {
-                  row_buffer[j] = pix;
+               if (getpix(row, j) <= max) {
+                  setpix(row, j, pix);
                   did++;
                } else {
                   finished[j]++;
@@ -690,6 +2302,7 @@ Image::boardFill()
         if (did == 0)
             break;
         // Put it back.
-        packrow(width, row_buffer, dp);
+        if (bpp != 1)
+            packrow(width, row_buffer, dp);
     }
 }
@@ -26,10 +26,26 @@
 
 // Basic image processing functions.
 #include "Obj.h"
+#include "JBIG2.h"
 
 #ifndef _IMAGE_H_
 #define _IMAGE_H_
+#include <stdint.h>
 #include <libxml/xmlIO.h>
+
+// Geometric transforms. Any mix of them is done as a transpose, then a
+// row reverse, then a flip.
+#define XF_TRANSPOSE    1
+#define XF_REVERSE      2
+#define XF_FLIP         4
+#define XF_CW           (XF_TRANSPOSE|XF_REVERSE)
+#define XF_CCW          (XF_TRANSPOSE|XF_FLIP)
+#define XF_ROTATE       (XF_REVERSE|XF_FLIP)
+
+// How encode put the data of an image.
+#define ENC_G4          1
+#define ENC_PNG         2
+#define ENC_SYMS        4               // JBIG2 text, needs the symbols.
         
 class   Image {
 public:
@@ -38,20 +54,44 @@ public:
         int                     height;
         int                     bpp;
         unsigned char           *data;
-        unsigned long int       hist[256];
+        unsigned long int       hist[256];      // Counts of values in data.
+        int                     hist_ok;        // hist is current.
+        unsigned char           map[256];       // Pending point operations.
+        int                     mapped;         // map not yet applied.
+        int                     idat;           // Size of PNG data held
+                                                // undecoded in data.
+        int                     dct;            // Size of JPEG data held
+                                                // undecoded in data.
+        int                     colors;         // Components per pixel.
+        int                     dpi;            // Resolution of the pixels,
+                                                // from the file if it has it.
+        unsigned char           *palette;       // RGB entries of an indexed
+                                                // image, 256 of them.
+        int                     pal_size;       // Entries used in palette.
+
+        Image() : width(0), height(0), bpp(0), data(0), hist_ok(0),
+                  mapped(0), idat(0), dct(0), colors(1), dpi(300),
+                  palette(0), pal_size(0) {};
+
+        ~Image() { delete data; delete[] palette; };
 
+        int open(xmlChar *name);
 
-        Image() : width(0), height(0), bpp(0), data(0) {};
+        int load(xmlChar *name, int limit = 0);
 
-        ~Image() { delete data; };
+        int d_width() { return ((long)width * 300000) / (4166L * dpi); };
 
-        int open(xmlChar *name);
+        int d_height() { return ((long)height * 300000) / (4166L * dpi); };
 
-        int d_width() { return (width * 1000) / 4166; };
+        Obj *save(Stream *strm);
 
-        int d_height() { return (height * 1000) / 4166; };
+        int encode(Stream *strm, JBIG2Syms *syms = 0);
 
-        Obj *save(Stream *strm);
+        Obj *save(Stream *strm, int how, JBIG2Syms *syms = 0);
+
+        uint64_t hash();
+
+        static uint64_t hashBytes(uint64_t h, const void *d, unsigned long n);
 
         void avg(int value);
 
@@ -69,16 +109,66 @@ public:
 
         void rotate180();
 
+        static int compose(int xf, int op);
+
+        void remap(int xf);
+
         void unsharp(int amount, int radius, int thresh);
 
         void contrast(int angle, int bright);
 
         void boardFill();
 
+        void normalize();
+
+        void downsample(int target);
+
 private:
+        int openJPEG(FILE *f, xmlChar *name);
+
+        int loadJPEG(FILE *f, xmlChar *name, int limit);
+
+        void count();
+
+        void convert(int gray);
+
+        void histogram(unsigned long int *h);
+
+        void addMap(unsigned char *m);
+
+        void applyMap();
+
         void unpackrow(int width, unsigned char *in, unsigned char *out);
 
         void packrow(int width, unsigned char *in, unsigned char *out);
+
+        void transposeN(int rx, int ry);
+
+        void transposeP(int rx, int ry, int nrw);
+
+        void transpose1(int rx, int ry);
+
+        void reverserow(unsigned char *in, unsigned char *out);
+
+        void mirror(int rx, int ry);
+
+        // Fetch and set pixels of a row that is either packed 1 bit or
+        // exploded to one byte per pixel.
+        int getpix(unsigned char *row, int x) {
+             if (bpp == 1)
+                 return (row[x >> 3] >> (7 - (x & 7))) & 1;
+             return row[x];
+        }
+
+        void setpix(unsigned char *row, int x, int v) {
+             if (bpp == 1) {
+                 if (v)
+                     row[x >> 3] |= 0x80 >> (x & 7);
+                 else
+                     row[x >> 3] &= ~(0x80 >> (x & 7));
+             } else
+                 row[x] = v;
+        }
 };
         
 #endif
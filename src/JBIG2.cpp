@@ -0,0 +1,1137 @@
+//
+//
+// Copyright 2019 Richard P. Cornwell All Rights Reserved,
+//
+// The software is provided "as is", without warranty of any kind, express
+// or implied, including but not limited to the warranties of
+// merchantability, fitness for a particular purpose and non-infringement.
+// In no event shall Richard Cornwell be liable for any claim, damages
+// or other liability, whether in an action of contract, tort or otherwise,
+// arising from, out of or in connection with the software or the use or other
+// dealings in the software.
+//
+// Permission to use, copy, and distribute this software and its
+// documentation for non commercial use is hereby granted,
+// provided that the above copyright notice appear in all copies and that
+// both that copyright notice and this permission notice appear in
+// supporting documentation.
+//
+// The sale, resale, or use of this program for profit without the
+// express written consent of the author Richard Cornwell is forbidden.
+//
+// This program uses a XML control file to generate a PDF file. This is used
+// to convert listings and images into a more easy to read format. This program
+// is also capable of doing limited black and white processing to scanned images
+// to make them easier to read.
+
+// JBIG2 encoding.
+//
+// Images are coded in the embedded stream form used by the PDF JBIG2Decode
+// filter. An image on its own is a single immediate generic region with
+// template 0, the default adaptive pixels and typical prediction.
+//
+// Text is split into its connected groups of black pixels, the symbols.
+// A symbol the same as one already seen in the section is sent as its
+// number, one that is close is sent as a refinement of it and the rest
+// become new symbols. The image is then a text region placing them, with
+// a generic region for anything too big to be a symbol. The symbols are
+// kept by the section and written last, as the dictionary segment of its
+// JBIG2Globals stream. Nothing is lost either way.
+//
+// The MQ coder follows T.88 annex E. JBIG2 uses 1 for black, so the image
+// bits are inverted.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include "JBIG2.h"
+
+// Probability estimation table, T.88 table E.1.
+static const struct qestate {
+        uint16_t        qe;
+        unsigned char   nmps;
+        unsigned char   nlps;
+        unsigned char   sw;
+} qe_table[47] = {
+    {0x5601,  1,  1, 1}, {0x3401,  2,  6, 0}, {0x1801,  3,  9, 0},
+    {0x0ac1,  4, 12, 0}, {0x0521,  5, 29, 0}, {0x0221, 38, 33, 0},
+    {0x5601,  7,  6, 1}, {0x5401,  8, 14, 0}, {0x4801,  9, 14, 0},
+    {0x3801, 10, 14, 0}, {0x3001, 11, 17, 0}, {0x2401, 12, 18, 0},
+    {0x1c01, 13, 20, 0}, {0x1601, 29, 21, 0}, {0x5601, 15, 14, 1},
+    {0x5401, 16, 14, 0}, {0x5101, 17, 15, 0}, {0x4801, 18, 16, 0},
+    {0x3801, 19, 17, 0}, {0x3401, 20, 18, 0}, {0x3001, 21, 19, 0},
+    {0x2801, 22, 19, 0}, {0x2401, 23, 20, 0}, {0x2201, 24, 21, 0},
+    {0x1c01, 25, 22, 0}, {0x1801, 26, 23, 0}, {0x1601, 27, 24, 0},
+    {0x1401, 28, 25, 0}, {0x1201, 29, 26, 0}, {0x1101, 30, 27, 0},
+    {0x0ac1, 31, 28, 0}, {0x09c1, 32, 29, 0}, {0x08a1, 33, 30, 0},
+    {0x0521, 34, 31, 0}, {0x0441, 35, 32, 0}, {0x02a1, 36, 33, 0},
+    {0x0221, 37, 34, 0}, {0x0141, 38, 35, 0}, {0x0111, 39, 36, 0},
+    {0x0085, 40, 37, 0}, {0x0049, 41, 38, 0}, {0x0025, 42, 39, 0},
+    {0x0015, 43, 40, 0}, {0x0009, 44, 41, 0}, {0x0005, 45, 42, 0},
+    {0x0001, 45, 43, 0}, {0x5601, 46, 46, 0}
+};
+
+// Adaptive template pixels, the defaults for template 0.
+static const signed char at_pixels[8] = {3, -1, -3, -1, 2, -2, -2, -2};
+
+// Context used for the typical prediction bit of template 0.
+#define SLTP_CX         0x9b25
+
+// Where each set of contexts starts. Generic regions use 16 bits of
+// context, refinements 13, integers 9 each and symbol numbers SYM_BITS.
+#define CX_GB           0x00000
+#define CX_GR           0x10000
+#define CX_IADH         0x12000
+#define CX_IADW         0x12200
+#define CX_IAEX         0x12400
+#define CX_IADT         0x12600
+#define CX_IAFS         0x12800
+#define CX_IADS         0x12a00
+#define CX_IAIT         0x12c00
+#define CX_IARI         0x12e00
+#define CX_IARDW        0x13000
+#define CX_IARDH        0x13200
+#define CX_IARDX        0x13400
+#define CX_IARDY        0x13600
+#define CX_IAID         0x13800
+#define CX_SIZE         (CX_IAID + (1 << SYM_BITS))
+
+// Out of band value for integers.
+#define OOB             INT_MIN
+
+// Segment types.
+#define SEG_SYMBOLS     0
+#define SEG_TEXT        6
+#define SEG_GENERIC     38
+#define SEG_PAGE        48
+
+// Symbols are placed by their bottom left corner, in strips 4 rows high.
+#define LOGSTRIPS       2
+#define STRIPS          (1 << LOGSTRIPS)
+
+// Pixels that may differ between a symbol and one it is coded as a
+// refinement of, SYM_ERR tenths of those set in it. And how much the sizes
+// may differ.
+#define SYM_ERR         4
+#define SYM_DIFF        2
+
+// A run of black pixels in a row.
+struct jbrun {
+        int             x0, x1;         // First and last pixel.
+        int             y;
+        int             up;             // Run it is joined to.
+};
+
+// A group of joined black pixels, and how it is coded.
+struct jbcomp {
+        int             x, y;           // Top left corner.
+        int             w, h;
+        int             black;          // Pixels set.
+        uint32_t        hash;           // Of the rows.
+        unsigned char   *bits;          // Rows of (w + 7) / 8 bytes.
+        int             num;            // Symbol, -1 if left in the image.
+        int             refine;         // Refinement of symbol num.
+        int             many;           // More than one in the image.
+        int             rdx, rdy;       // Move of symbol num to match.
+};
+
+// Fetch pixel x of a row.
+static inline int
+bit(const unsigned char *row, int x)
+{
+    return (row[x >> 3] >> (7 - (x & 7))) & 1;
+}
+
+// Fetch pixel x of a row w pixels wide, or 0 outside of it.
+static inline int
+pixel(const unsigned char *row, int w, int x)
+{
+    if (row == 0 || x < 0 || x >= w)
+        return 0;
+    return bit(row, x);
+}
+
+// Fetch the 64 pixels of a row of n bytes from x on, 0 outside of it.
+static uint64_t
+bits64(const unsigned char *row, int n, int x)
+{
+    uint64_t        v = 0;
+    int             b = x >> 3;
+    int             s = x & 7;
+    int             i, k;
+
+    if (row == 0)
+        return 0;
+    for (i = 0; i < 8; i++) {
+        k = b + i;
+        v = (v << 8) | ((k >= 0 && k < n) ? row[k] : 0);
+    }
+    k = b + 8;
+    return (v << s) | (((k >= 0 && k < n) ? row[k] : 0) >> (8 - s));
+}
+
+// Find the first pixel from x on that is set, or clear.
+static int
+scan(const unsigned char *row, int x, int width, int set)
+{
+    unsigned char   skip = set ? 0 : 0xff;
+
+    while (x < width) {
+        if ((x & 7) == 0 && row[x >> 3] == skip)
+            x += 8;
+        else if (bit(row, x) == set)
+            return x;
+        else
+            x++;
+    }
+    return width;
+}
+
+// Set or clear pixels x0 to x1 of a row.
+static void
+fill(unsigned char *row, int x0, int x1, int set)
+{
+    unsigned char   m;
+
+    for (; x0 <= x1; x0++) {
+        if ((x0 & 7) == 0 && x0 + 7 <= x1) {
+            row[x0 >> 3] = set ? 0xff : 0;
+            x0 += 7;
+            continue;
+        }
+        m = 0x80 >> (x0 & 7);
+        if (set)
+            row[x0 >> 3] |= m;
+        else
+            row[x0 >> 3] &= ~m;
+    }
+}
+
+// Hash the n bytes of a symbol.
+static uint32_t
+hash(const unsigned char *p, int n)
+{
+    uint32_t        h = 2166136261u;
+
+    while (n-- > 0)
+        h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+// Slot in the table by size for a symbol.
+static inline int
+slot(int w, int h)
+{
+    return (w * 31 + h) & (SYM_SLOTS - 1);
+}
+
+// The run set i is part of.
+static int
+root(struct jbrun *run, int i)
+{
+    while (run[i].up != i) {
+        run[i].up = run[run[i].up].up;
+        i = run[i].up;
+    }
+    return i;
+}
+
+// Join the sets of runs i and j, the lowest run names the set.
+static void
+join(struct jbrun *run, int i, int j)
+{
+    i = root(run, i);
+    j = root(run, j);
+    if (i < j)
+        run[j].up = i;
+    else if (j < i)
+        run[i].up = j;
+}
+
+// Count the pixels that differ between a and b, with b moved dx, dy. Stops
+// counting once there are limit.
+static int
+differ(const unsigned char *a, int aw, int ah, const unsigned char *b,
+       int bw, int bh, int dx, int dy, int limit)
+{
+    const unsigned char *ra, *rb;
+    int             an = (aw + 7) >> 3;
+    int             bn = (bw + 7) >> 3;
+    int             x0 = (dx < 0) ? dx : 0;
+    int             x1 = (aw > bw + dx) ? aw : bw + dx;
+    int             y0 = (dy < 0) ? dy : 0;
+    int             y1 = (ah > bh + dy) ? ah : bh + dy;
+    int             n = 0;
+    int             x, y;
+
+    for (y = y0; y < y1 && n < limit; y++) {
+        ra = (y >= 0 && y < ah) ? a + y * an : 0;
+        rb = (y - dy >= 0 && y - dy < bh) ? b + (y - dy) * bn : 0;
+        for (x = x0; x < x1; x += 64)
+            n += __builtin_popcountll(bits64(ra, an, x) ^
+                                      bits64(rb, bn, x - dx));
+    }
+    return n;
+}
+
+// Order groups by their pixels.
+static int
+pixels(const void *a, const void *b)
+{
+    const struct jbcomp *ca = *(const struct jbcomp * const *)a;
+    const struct jbcomp *cb = *(const struct jbcomp * const *)b;
+
+    if (ca->hash != cb->hash)
+        return (ca->hash < cb->hash) ? -1 : 1;
+    if (ca->w != cb->w)
+        return ca->w - cb->w;
+    if (ca->h != cb->h)
+        return ca->h - cb->h;
+    return memcmp(ca->bits, cb->bits, ((ca->w + 7) >> 3) * ca->h);
+}
+
+// Order groups by strip, then left to right.
+static int
+placed(const void *a, const void *b)
+{
+    const struct jbcomp *ca = *(const struct jbcomp * const *)a;
+    const struct jbcomp *cb = *(const struct jbcomp * const *)b;
+    int             sa = (ca->y + ca->h - 1) >> LOGSTRIPS;
+    int             sb = (cb->y + cb->h - 1) >> LOGSTRIPS;
+
+    if (sa != sb)
+        return sa - sb;
+    return ca->x - cb->x;
+}
+
+//
+// Find the symbol c is, or failing that the one most like it, if it is
+// close enough to code c as a refinement of it.
+int
+JBIG2Syms::find(struct jbcomp *c)
+{
+    struct symbol   *s, *best = 0;
+    int             n = ((c->w + 7) >> 3) * c->h;
+    int             err = c->black * SYM_ERR / 10 + 1;
+    int             dw, dh, dx, dy, x, y, e;
+
+    for (s = sizes[slot(c->w, c->h)]; s != 0; s = s->next) {
+        if (s->hash == c->hash && s->w == c->w && s->h == c->h &&
+                memcmp(s->bits, c->bits, n) == 0) {
+            c->num = s->num;
+            return 1;
+        }
+    }
+    // One of many the same is a symbol of its own.
+    if (c->many)
+        return 0;
+    // The symbol is centered on c, unless moved.
+    for (dh = -SYM_DIFF; dh <= SYM_DIFF; dh++) {
+        for (dw = -SYM_DIFF; dw <= SYM_DIFF; dw++) {
+            if (c->w + dw < 1 || c->h + dh < 1)
+                continue;
+            for (s = sizes[slot(c->w + dw, c->h + dh)]; s != 0; s = s->next) {
+                if (s->w != c->w + dw || s->h != c->h + dh ||
+                        abs(s->black - c->black) >= err)
+                    continue;
+                e = differ(c->bits, c->w, c->h, s->bits, s->w, s->h,
+                           -dw >> 1, -dh >> 1, err);
+                if (e < err) {
+                    err = e;
+                    best = s;
+                }
+            }
+        }
+    }
+    if (best == 0)
+        return 0;
+    c->num = best->num;
+    c->refine = 1;
+    dx = (c->w - best->w) >> 1;
+    dy = (c->h - best->h) >> 1;
+    for (y = -1; y <= 1; y++) {
+        for (x = -1; x <= 1; x++) {
+            if (x == 0 && y == 0)
+                continue;
+            e = differ(c->bits, c->w, c->h, best->bits, best->w, best->h,
+                       dx + x, dy + y, err);
+            if (e < err) {
+                err = e;
+                c->rdx = x;
+                c->rdy = y;
+            }
+        }
+    }
+    return 1;
+}
+
+//
+// Add c as a new symbol. Returns its number, or -1 if there is no room.
+int
+JBIG2Syms::add(struct jbcomp *c)
+{
+    struct symbol   *s;
+    int             n = ((c->w + 7) >> 3) * c->h;
+    int             i;
+
+    if (count == (1 << SYM_BITS))
+        return -1;
+    s = new struct symbol;
+    s->num = count;
+    s->w = c->w;
+    s->h = c->h;
+    s->black = c->black;
+    s->hash = c->hash;
+    s->bits = new unsigned char[n];
+    memcpy(s->bits, c->bits, n);
+    i = slot(c->w, c->h);
+    s->next = sizes[i];
+    sizes[i] = s;
+    syms[count++] = s;
+    return s->num;
+}
+
+//
+// Encode an image of packed 1 bit rows, 1 is white, as a generic region.
+// The result is left in out.
+void
+JBIG2::encode(unsigned char *data, int width, int height, int row_width)
+{
+    unsigned int    start;
+    int             i;
+
+    delete[] out;
+    len = 0;
+    size = (row_width * height) / 8 + 1024;
+    out = new unsigned char[size];
+    page(0, width, height);
+
+    // Generic region covering the page, length is filled in at the end.
+    segment(1, SEG_GENERIC, 0);
+    start = len;
+    region(width, height, 0, 0);
+    out[len++] = 0x08;          // Template 0, typical prediction.
+    for (i = 0; i < 8; i++)
+        out[len++] = (unsigned char)at_pixels[i];
+    reset();
+    generic(data, width, height, row_width, 0xff, 1);
+    grow(16);
+    flush();
+    setlen(start);
+}
+
+//
+// Encode an image of packed 1 bit rows, 1 is white, as text made of the
+// symbols in syms, adding any new ones. Returns 0 with nothing done if
+// there is no text in the image, otherwise the result is left in out.
+int
+JBIG2::encode(unsigned char *data, int width, int height, int row_width,
+              JBIG2Syms *syms)
+{
+    unsigned char   *pix, *row, *pool, *p;
+    unsigned char   mask;
+    struct jbrun    *run, *nrun;
+    struct jbcomp   *comp, *c, **list;
+    struct JBIG2Syms::symbol *s;
+    unsigned int    start;
+    int             *first, *lab;
+    int             runs, maxrun, ncomp, nlist, ninst, refined;
+    int             x, y, i, j, k, e, n;
+    int             t, stript, firsts, curs;
+    int             x0, x1, y0, y1;
+
+    // Work on a copy with 1 for black, the symbols are taken out of it.
+    pix = new unsigned char[row_width * height];
+    mask = (width & 7) ? (0xff << (8 - (width & 7))) : 0xff;
+    for (y = 0; y < height; y++) {
+        row = &pix[y * row_width];
+        for (i = 0; i < row_width; i++)
+            row[i] = ~data[y * row_width + i];
+        row[row_width - 1] &= mask;
+    }
+
+    // Find the runs in each row, joining them to runs touching them in the
+    // row above, corners count.
+    maxrun = 4096;
+    run = new struct jbrun[maxrun];
+    runs = 0;
+    first = new int[height + 1];
+    for (y = 0; y < height; y++) {
+        first[y] = runs;
+        row = &pix[y * row_width];
+        x = 0;
+        while ((x = scan(row, x, width, 1)) < width) {
+            if (runs == maxrun) {
+                nrun = new struct jbrun[maxrun * 2];
+                memcpy(nrun, run, maxrun * sizeof(struct jbrun));
+                delete[] run;
+                run = nrun;
+                maxrun *= 2;
+            }
+            run[runs].x0 = x;
+            x = scan(row, x, width, 0);
+            run[runs].x1 = x - 1;
+            run[runs].y = y;
+            run[runs].up = runs;
+            runs++;
+        }
+        if (y == 0)
+            continue;
+        k = first[y - 1];
+        for (i = first[y]; i < runs; i++) {
+            while (k < first[y] && run[k].x1 < run[i].x0 - 1)
+                k++;
+            for (j = k; j < first[y] && run[j].x0 <= run[i].x1 + 1; j++)
+                join(run, i, j);
+        }
+    }
+    first[height] = runs;
+
+    // Each set of runs is a group, find where they are.
+    lab = new int[runs + 1];
+    ncomp = 0;
+    for (i = 0; i < runs; i++) {
+        j = root(run, i);
+        lab[i] = (j == i) ? ncomp++ : lab[j];
+    }
+    comp = new struct jbcomp[ncomp + 1];
+    for (i = 0; i < ncomp; i++) {
+        comp[i].x = width;
+        comp[i].y = height;
+        comp[i].w = comp[i].h = 0;
+        comp[i].black = 0;
+        comp[i].bits = 0;
+        comp[i].num = -1;
+        comp[i].refine = 0;
+        comp[i].rdx = comp[i].rdy = 0;
+    }
+    for (i = 0; i < runs; i++) {
+        c = &comp[lab[i]];
+        if (run[i].x0 < c->x)
+            c->x = run[i].x0;
+        if (run[i].y < c->y)
+            c->y = run[i].y;
+        if (run[i].x1 >= c->w)
+            c->w = run[i].x1 + 1;
+        if (run[i].y >= c->h)
+            c->h = run[i].y + 1;
+        c->black += run[i].x1 - run[i].x0 + 1;
+    }
+
+    // Groups small enough are symbols, taken out of the image.
+    nlist = 0;
+    n = 0;
+    for (i = 0; i < ncomp; i++) {
+        c = &comp[i];
+        c->w -= c->x;
+        c->h -= c->y;
+        if (c->w <= SYM_MAX && c->h <= SYM_MAX) {
+            nlist++;
+            n += ((c->w + 7) >> 3) * c->h;
+        }
+    }
+    if (nlist == 0) {
+        delete[] comp;
+        delete[] lab;
+        delete[] first;
+        delete[] run;
+        delete[] pix;
+        return 0;
+    }
+    pool = new unsigned char[n];
+    memset(pool, 0, n);
+    list = new struct jbcomp *[nlist];
+    nlist = 0;
+    p = pool;
+    for (i = 0; i < ncomp; i++) {
+        c = &comp[i];
+        if (c->w <= SYM_MAX && c->h <= SYM_MAX) {
+            c->bits = p;
+            p += ((c->w + 7) >> 3) * c->h;
+            list[nlist++] = c;
+        }
+    }
+    for (i = 0; i < runs; i++) {
+        c = &comp[lab[i]];
+        if (c->bits == 0)
+            continue;
+        fill(c->bits + (run[i].y - c->y) * ((c->w + 7) >> 3),
+             run[i].x0 - c->x, run[i].x1 - c->x, 1);
+        fill(&pix[run[i].y * row_width], run[i].x0, run[i].x1, 0);
+    }
+    delete[] lab;
+    delete[] first;
+    delete[] run;
+
+    // Find the ones that are there more than once.
+    for (i = 0; i < nlist; i++) {
+        c = list[i];
+        c->hash = hash(c->bits, ((c->w + 7) >> 3) * c->h);
+        c->many = 0;
+    }
+    qsort(list, nlist, sizeof(struct jbcomp *), pixels);
+    for (i = 1; i < nlist; i++) {
+        if (pixels(&list[i - 1], &list[i]) == 0)
+            list[i - 1]->many = list[i]->many = 1;
+    }
+
+    // Match them up with the symbols, in the order they are placed.
+    qsort(list, nlist, sizeof(struct jbcomp *), placed);
+    ninst = 0;
+    refined = 0;
+    for (i = 0; i < nlist; i++) {
+        c = list[i];
+        k = (c->w + 7) >> 3;
+        if (!syms->find(c) && (c->num = syms->add(c)) < 0) {
+            // No room left, it stays in the image.
+            for (y = 0; y < c->h; y++) {
+                row = &pix[(c->y + y) * row_width];
+                for (x = 0; x < c->w; x++) {
+                    if (bit(&c->bits[y * k], x))
+                        row[(c->x + x) >> 3] |= 0x80 >> ((c->x + x) & 7);
+                }
+            }
+            continue;
+        }
+        list[ninst++] = c;
+        refined |= c->refine;
+    }
+
+    delete[] out;
+    len = 0;
+    size = (row_width * height) / 8 + 1024;
+    out = new unsigned char[size];
+    page(1, width, height);
+
+    // Text region placing the symbols, refers to the dictionary.
+    segment(2, SEG_TEXT, 0, 1, 0);
+    start = len;
+    region(width, height, 0, 0);
+    // Arithmetic coding, bottom left corners, OR, refinement template 0.
+    out[len++] = 0;
+    out[len++] = (LOGSTRIPS << 2) | (refined ? 0x02 : 0);
+    if (refined) {
+        // Both refinement adaptive pixels at -1, -1.
+        for (i = 0; i < 4; i++)
+            out[len++] = 0xff;
+    }
+    put32(ninst);
+    reset();
+    integer(CX_IADT, 0);
+    stript = 0;
+    firsts = 0;
+    for (i = 0; i < ninst; ) {
+        c = list[i];
+        t = (c->y + c->h - 1) & ~(STRIPS - 1);
+        integer(CX_IADT, (t - stript) >> LOGSTRIPS);
+        stript = t;
+        integer(CX_IAFS, c->x - firsts);
+        firsts = c->x;
+        curs = c->x;
+        for (j = i; i < ninst; i++) {
+            c = list[i];
+            if (((c->y + c->h - 1) & ~(STRIPS - 1)) != t)
+                break;
+            grow(1024 + 2 * c->w * c->h);
+            // The first in a strip is placed by IAFS.
+            if (i != j)
+                integer(CX_IADS, c->x - curs);
+            if (STRIPS > 1)
+                integer(CX_IAIT, c->y + c->h - 1 - t);
+            symbol(c->num);
+            if (refined)
+                integer(CX_IARI, c->refine);
+            if (c->refine) {
+                s = syms->syms[c->num];
+                integer(CX_IARDW, c->w - s->w);
+                integer(CX_IARDH, c->h - s->h);
+                integer(CX_IARDX, c->rdx);
+                integer(CX_IARDY, c->rdy);
+                refine(c->bits, c->w, c->h, s->bits, s->w, s->h,
+                       ((c->w - s->w) >> 1) + c->rdx,
+                       ((c->h - s->h) >> 1) + c->rdy);
+            }
+            curs = c->x + c->w - 1;
+        }
+        integer(CX_IADS, OOB);
+    }
+    grow(16);
+    flush();
+    setlen(start);
+    delete[] list;
+    delete[] pool;
+    delete[] comp;
+
+    // A generic region for what is left, covering only the rows and bytes
+    // with something in them.
+    y0 = x0 = INT_MAX;
+    y1 = x1 = -1;
+    for (y = 0; y < height; y++) {
+        row = &pix[y * row_width];
+        for (i = 0; i < row_width; i++) {
+            if (row[i] == 0)
+                continue;
+            if (y0 == INT_MAX)
+                y0 = y;
+            y1 = y;
+            if (i < x0)
+                x0 = i;
+            break;
+        }
+        for (i = row_width - 1; i >= 0 && row[i] == 0; i--)
+            ;
+        if (i > x1)
+            x1 = i;
+    }
+    if (y1 >= 0) {
+        n = x1 - x0 + 1;
+        e = (x1 == row_width - 1) ? width - x0 * 8 : n * 8;
+        for (y = y0; y <= y1; y++)
+            memmove(&pix[(y - y0) * n], &pix[y * row_width + x0], n);
+        segment(3, SEG_GENERIC, 0);
+        start = len;
+        region(e, y1 - y0 + 1, x0 * 8, y0);
+        out[len++] = 0x08;      // Template 0, typical prediction.
+        for (i = 0; i < 8; i++)
+            out[len++] = (unsigned char)at_pixels[i];
+        reset();
+        generic(pix, e, y1 - y0 + 1, n, 0, 1);
+        grow(16);
+        flush();
+        setlen(start);
+    }
+    delete[] pix;
+    return 1;
+}
+
+//
+// Encode the symbols of a section as a symbol dictionary segment, for its
+// JBIG2Globals stream. Symbol numbers are SYM_BITS long in the images, so
+// there must be more than half that many symbols. Blank 1 by 1 symbols
+// make up the number, each takes a fraction of a bit.
+void
+JBIG2::dict(JBIG2Syms *syms)
+{
+    static const unsigned char blank = 0;
+    struct JBIG2Syms::symbol *s;
+    unsigned int    start;
+    int             n, w, h, hc;
+    int             i, j;
+
+    n = syms->count;
+    if (n <= (1 << (SYM_BITS - 1)))
+        n = (1 << (SYM_BITS - 1)) + 1;
+    delete[] out;
+    len = 0;
+    size = 65536;
+    out = new unsigned char[size];
+    segment(0, SEG_SYMBOLS, 0, 0);
+    start = len;
+    // Arithmetic coding, template 0, no refinement or aggregation.
+    out[len++] = 0;
+    out[len++] = 0;
+    for (i = 0; i < 8; i++)
+        out[len++] = (unsigned char)at_pixels[i];
+    put32(n);
+    put32(n);
+    reset();
+    // Symbols go in height classes, runs of symbols of the same height.
+    hc = 0;
+    for (i = 0; i < n; i = j) {
+        h = (i < syms->count) ? syms->syms[i]->h : 1;
+        grow(1024);
+        integer(CX_IADH, h - hc);
+        hc = h;
+        w = 0;
+        for (j = i; j < n; j++) {
+            if (j < syms->count) {
+                s = syms->syms[j];
+                if (s->h != h)
+                    break;
+                grow(1024 + 2 * s->w * s->h);
+                integer(CX_IADW, s->w - w);
+                w = s->w;
+                generic(s->bits, s->w, s->h, (s->w + 7) >> 3, 0, 0);
+            } else {
+                if (h != 1)
+                    break;
+                grow(1024);
+                integer(CX_IADW, 1 - w);
+                w = 1;
+                generic(&blank, 1, 1, 1, 0, 0);
+            }
+        }
+        integer(CX_IADW, OOB);
+    }
+    // All of them are exported.
+    grow(1024);
+    integer(CX_IAEX, 0);
+    integer(CX_IAEX, n);
+    flush();
+    setlen(start);
+}
+
+//
+// Put out a 4 byte big endian value.
+void
+JBIG2::put32(uint32_t v)
+{
+    out[len++] = (unsigned char)(v >> 24);
+    out[len++] = (unsigned char)(v >> 16);
+    out[len++] = (unsigned char)(v >> 8);
+    out[len++] = (unsigned char)v;
+}
+
+//
+// Put out a segment header. It refers to segment ref if that is not -1,
+// page 0 holds segments used by all pages.
+void
+JBIG2::segment(int number, int type, unsigned int length, int page, int ref)
+{
+    put32(number);
+    out[len++] = type;
+    if (ref < 0) {
+        out[len++] = 0;
+    } else {
+        out[len++] = 0x20;      // One segment, numbered in a byte.
+        out[len++] = ref;
+    }
+    out[len++] = page;
+    put32(length);
+}
+
+//
+// Put out the page information segment. No resolution, eventually
+// lossless, no striping.
+void
+JBIG2::page(int number, int width, int height)
+{
+    segment(number, SEG_PAGE, 19);
+    put32(width);
+    put32(height);
+    put32(0);
+    put32(0);
+    out[len++] = 0x01;
+    out[len++] = 0;
+    out[len++] = 0;
+}
+
+//
+// Put out the start of a region segment, where it goes on the page and
+// that it is ORed on.
+void
+JBIG2::region(int width, int height, int x, int y)
+{
+    put32(width);
+    put32(height);
+    put32(x);
+    put32(y);
+    out[len++] = 0;
+}
+
+//
+// Fill in the length of the segment with data from start on.
+void
+JBIG2::setlen(unsigned int start)
+{
+    unsigned int    n = len - start;
+
+    out[start - 4] = (unsigned char)(n >> 24);
+    out[start - 3] = (unsigned char)(n >> 16);
+    out[start - 2] = (unsigned char)(n >> 8);
+    out[start - 1] = (unsigned char)n;
+}
+
+//
+// Start the arithmetic coder for a segment, all contexts back to their
+// first state.
+void
+JBIG2::reset()
+{
+    a = 0x8000;
+    c = 0;
+    ct = 12;
+    b = 0;
+    bp = -1;
+    if (index == 0) {
+        index = new unsigned char[CX_SIZE];
+        mps = new unsigned char[CX_SIZE];
+    }
+    memset(index, 0, CX_SIZE);
+    memset(mps, 0, CX_SIZE);
+}
+
+//
+// Code a generic region with template 0 and the default adaptive pixels.
+// Rows are XORed with flip to make 1 black, pixels past width are not
+// used. With tpgd set a row the same as the one above is sent as one bit.
+void
+JBIG2::generic(const unsigned char *data, int width, int height,
+               int row_width, unsigned char flip, int tpgd)
+{
+    unsigned char   *rows, *r0, *r1, *r2, *t;
+    const unsigned char *sp;
+    unsigned char   mask;
+    uint32_t        w0, w1, w2;
+    int             rw = row_width + 2;
+    int             ltp = 0;
+    int             same;
+    int             pix;
+    int             x, y, i;
+
+    // Three rows, with two bytes of white past the end for the template
+    // to look at. Rows above the image are white.
+    rows = new unsigned char[3 * rw];
+    memset(rows, 0, 3 * rw);
+    r2 = rows;
+    r1 = rows + rw;
+    r0 = rows + 2 * rw;
+    mask = (width & 7) ? (0xff << (8 - (width & 7))) : 0xff;
+    for (y = 0; y < height; y++) {
+        sp = &data[y * row_width];
+        for (i = 0; i < row_width; i++)
+            r0[i] = sp[i] ^ flip;
+        r0[row_width - 1] &= mask;
+        if (tpgd) {
+            same = (memcmp(r0, r1, row_width) == 0);
+            code(SLTP_CX, same != ltp);
+            ltp = same;
+        }
+        if (!ltp) {
+            grow(2 * width + 16);
+            w2 = (bit(r2, 0) << 2) | (bit(r2, 1) << 1) | bit(r2, 2);
+            w1 = (bit(r1, 0) << 3) | (bit(r1, 1) << 2) | (bit(r1, 2) << 1) |
+                 bit(r1, 3);
+            w0 = 0;
+            // The context is x-2 to x+2 of row y-2, x-3 to x+3 of row y-1
+            // and x-4 to x-1 of this row, nearest pixel in the low bit.
+            for (x = 0; x < width; x++) {
+                pix = bit(r0, x);
+                code(CX_GB + ((w2 << 11) | (w1 << 4) | w0), pix);
+                w0 = ((w0 << 1) | pix) & 0xf;
+                w1 = ((w1 << 1) | bit(r1, x + 4)) & 0x7f;
+                w2 = ((w2 << 1) | bit(r2, x + 3)) & 0x1f;
+            }
+        }
+        t = r2;
+        r2 = r1;
+        r1 = r0;
+        r0 = t;
+    }
+    delete[] rows;
+}
+
+//
+// Code the w by h bitmap bits as a refinement of the rw by rh bitmap ref,
+// placed at dx, dy. Template 0 with both adaptive pixels at -1, -1, the
+// context is the four pixels coded next to this one and the 3 by 3 pixels
+// of ref around it.
+void
+JBIG2::refine(const unsigned char *bits, int w, int h,
+              const unsigned char *ref, int rw, int rh, int dx, int dy)
+{
+    const unsigned char *cur, *up, *r0, *r1, *r2;
+    uint32_t        c0, c1, u0, u1, u2;
+    int             bn = (w + 7) >> 3;
+    int             rn = (rw + 7) >> 3;
+    int             x, y, rx, ry;
+    int             pix;
+
+    for (y = 0; y < h; y++) {
+        cur = &bits[y * bn];
+        up = (y > 0) ? cur - bn : 0;
+        ry = y - dy;
+        r0 = (ry - 1 >= 0 && ry - 1 < rh) ? &ref[(ry - 1) * rn] : 0;
+        r1 = (ry >= 0 && ry < rh) ? &ref[ry * rn] : 0;
+        r2 = (ry + 1 >= 0 && ry + 1 < rh) ? &ref[(ry + 1) * rn] : 0;
+        rx = -dx;
+        c0 = 0;
+        c1 = (pixel(up, w, -1) << 2) | (pixel(up, w, 0) << 1) |
+             pixel(up, w, 1);
+        u0 = (pixel(r0, rw, rx - 1) << 2) | (pixel(r0, rw, rx) << 1) |
+             pixel(r0, rw, rx + 1);
+        u1 = (pixel(r1, rw, rx - 1) << 2) | (pixel(r1, rw, rx) << 1) |
+             pixel(r1, rw, rx + 1);
+        u2 = (pixel(r2, rw, rx - 1) << 2) | (pixel(r2, rw, rx) << 1) |
+             pixel(r2, rw, rx + 1);
+        for (x = 0; x < w; x++, rx++) {
+            pix = bit(cur, x);
+            code(CX_GR + ((c0 << 12) | (c1 << 9) | (u0 << 6) | (u1 << 3) | u2),
+                 pix);
+            c0 = pix;
+            c1 = ((c1 << 1) | pixel(up, w, x + 2)) & 7;
+            u0 = ((u0 << 1) | pixel(r0, rw, rx + 2)) & 7;
+            u1 = ((u1 << 1) | pixel(r1, rw, rx + 2)) & 7;
+            u2 = ((u2 << 1) | pixel(r2, rw, rx + 2)) & 7;
+        }
+    }
+}
+
+//
+// Code the integer v, or OOB, with the 512 contexts from cx. The sign goes
+// first, then a prefix saying how many bits follow, T.88 annex A.2.
+void
+JBIG2::integer(int cx, int v)
+{
+    uint64_t        bits;
+    uint32_t        m;
+    int             s, n, pre, plen;
+    int             prev = 1;
+    int             d, i;
+
+    if (v == OOB) {
+        s = 1;
+        m = 0;
+    } else {
+        s = (v < 0);
+        m = s ? -(uint32_t)v : (uint32_t)v;
+    }
+    if (m < 4) {
+        pre = 0; plen = 1; n = 2;
+    } else if (m < 20) {
+        pre = 2; plen = 2; n = 4; m -= 4;
+    } else if (m < 84) {
+        pre = 6; plen = 3; n = 6; m -= 20;
+    } else if (m < 340) {
+        pre = 14; plen = 4; n = 8; m -= 84;
+    } else if (m < 4436) {
+        pre = 30; plen = 5; n = 12; m -= 340;
+    } else {
+        pre = 31; plen = 5; n = 32; m -= 4436;
+    }
+    bits = ((uint64_t)s << (plen + n)) | ((uint64_t)pre << n) | m;
+    for (i = plen + n; i >= 0; i--) {
+        d = (bits >> i) & 1;
+        code(cx + prev, d);
+        if (prev < 256)
+            prev = (prev << 1) | d;
+        else
+            prev = (((prev << 1) | d) & 511) | 256;
+    }
+}
+
+//
+// Code symbol number v, SYM_BITS long, T.88 annex A.3.
+void
+JBIG2::symbol(int v)
+{
+    int             prev = 1;
+    int             d, i;
+
+    for (i = SYM_BITS - 1; i >= 0; i--) {
+        d = (v >> i) & 1;
+        code(CX_IAID + prev, d);
+        prev = (prev << 1) | d;
+    }
+}
+
+//
+// Code one decision in context cx.
+void
+JBIG2::code(int cx, int d)
+{
+    const struct qestate *q = &qe_table[index[cx]];
+    uint32_t        qe = q->qe;
+
+    a -= qe;
+    if (d == mps[cx]) {
+        if (a & 0x8000) {
+            c += qe;
+            return;
+        }
+        if (a < qe)
+            a = qe;
+        else
+            c += qe;
+        index[cx] = q->nmps;
+    } else {
+        if (a < qe)
+            c += qe;
+        else
+            a = qe;
+        if (q->sw)
+            mps[cx] ^= 1;
+        index[cx] = q->nlps;
+    }
+    renorm();
+}
+
+//
+// Move a byte from c to the output, handling carries and bit stuffing
+// after 0xff.
+void
+JBIG2::byteout()
+{
+    if (b != 0xff) {
+        if (c >= 0x8000000) {
+            b++;
+            if (b == 0xff) {
+                c &= 0x7ffffff;
+            } else {
+                emit();
+                b = c >> 19;
+                bp++;
+                c &= 0x7ffff;
+                ct = 8;
+                return;
+            }
+        } else {
+            emit();
+            b = c >> 19;
+            bp++;
+            c &= 0x7ffff;
+            ct = 8;
+            return;
+        }
+    }
+    emit();
+    b = c >> 20;
+    bp++;
+    c &= 0xfffff;
+    ct = 7;
+}
+
+//
+// Finish off the coded data, ending with the 0xff 0xac marker.
+void
+JBIG2::flush()
+{
+    uint32_t        t = c + a;
+
+    c |= 0xffff;
+    if (c >= t)
+        c -= 0x8000;
+    c <<= ct;
+    byteout();
+    c <<= ct;
+    byteout();
+    emit();
+    if (b != 0xff) {
+        bp++;
+        b = 0xff;
+        emit();
+    }
+    bp++;
+    b = 0xac;
+    emit();
+}
+
+//
+// Make sure there is room for need more bytes.
+void
+JBIG2::grow(unsigned int need)
+{
+    unsigned char   *n;
+
+    if (len + need <= size)
+        return;
+    while (len + need > size)
+        size *= 2;
+    n = new unsigned char[size];
+    memcpy(n, out, len);
+    delete[] out;
+    out = n;
+}
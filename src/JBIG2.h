@@ -0,0 +1,158 @@
+//
+//
+// Copyright 2019 Richard P. Cornwell All Rights Reserved,
+//
+// The software is provided "as is", without warranty of any kind, express
+// or implied, including but not limited to the warranties of
+// merchantability, fitness for a particular purpose and non-infringement.
+// In no event shall Richard Cornwell be liable for any claim, damages
+// or other liability, whether in an action of contract, tort or otherwise,
+// arising from, out of or in connection with the software or the use or other
+// dealings in the software.
+//
+// Permission to use, copy, and distribute this software and its
+// documentation for non commercial use is hereby granted,
+// provided that the above copyright notice appear in all copies and that
+// both that copyright notice and this permission notice appear in
+// supporting documentation.
+//
+// The sale, resale, or use of this program for profit without the
+// express written consent of the author Richard Cornwell is forbidden.
+//
+// This program uses a XML control file to generate a PDF file. This is used
+// to convert listings and images into a more easy to read format. This program
+// is also capable of doing limited black and white processing to scanned images
+// to make them easier to read.
+
+// JBIG2 encoding of 1 bit images, as a generic region or as text made of
+// symbols shared by the images of a section.
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _JBIG2_H_
+#define _JBIG2_H_
+class   Obj;
+struct  jbcomp;
+
+#define SYM_BITS        12              // Bits in a symbol number.
+#define SYM_MAX         256             // Largest symbol, either way.
+#define SYM_SLOTS       256             // Slots in the table by size.
+
+// Symbols found in the images of a section. Images refer to them by number
+// and they are written once, as the JBIG2Globals stream of the section.
+class   JBIG2Syms {
+friend class JBIG2;
+public:
+        Obj             *obj;           // JBIG2Globals stream, once used.
+        int             count;          // Symbols found.
+private:
+        struct symbol {
+             int                num;
+             int                w, h;
+             int                black;  // Pixels set.
+             uint32_t           hash;   // Of the rows.
+             unsigned char      *bits;  // Rows of (w + 7) / 8 bytes.
+             struct symbol      *next;  // Same slot in sizes.
+        }               **syms;         // By number.
+        struct symbol   *sizes[SYM_SLOTS];      // By size.
+
+public:
+        JBIG2Syms() : obj(0), count(0) {
+            syms = new struct symbol *[1 << SYM_BITS];
+            memset(sizes, 0, sizeof(sizes));
+        };
+
+        ~JBIG2Syms() {
+            while (count > 0) {
+                count--;
+                delete[] syms[count]->bits;
+                delete syms[count];
+            }
+            delete[] syms;
+        };
+
+        // No room for the symbols of another page.
+        int full() { return count > (1 << SYM_BITS) - (1 << (SYM_BITS - 2)); };
+
+private:
+        int find(struct jbcomp *c);
+
+        int add(struct jbcomp *c);
+};
+
+class   JBIG2 {
+public:
+        unsigned char   *out;           // Encoded data.
+        unsigned int    len;            // Number of bytes in out.
+private:
+        unsigned int    size;           // Space allocated for out.
+        // Arithmetic coder state.
+        uint32_t        a;
+        uint32_t        c;
+        int             ct;
+        int             b;              // Byte waiting to go out.
+        int             bp;             // -1 until the first real byte.
+        unsigned char   *index;         // Probability state of each context.
+        unsigned char   *mps;           // More probable symbol of context.
+
+public:
+        JBIG2() : out(0), len(0), size(0), index(0), mps(0) {};
+
+        ~JBIG2() { delete[] out; delete[] index; delete[] mps; };
+
+        void encode(unsigned char *data, int width, int height,
+                    int row_width);
+
+        int encode(unsigned char *data, int width, int height,
+                   int row_width, JBIG2Syms *syms);
+
+        void dict(JBIG2Syms *syms);
+
+private:
+        void put32(uint32_t v);
+
+        void segment(int number, int type, unsigned int length,
+                     int page = 1, int ref = -1);
+
+        void page(int number, int width, int height);
+
+        void region(int width, int height, int x, int y);
+
+        void setlen(unsigned int start);
+
+        void grow(unsigned int need);
+
+        void reset();
+
+        void generic(const unsigned char *data, int width, int height,
+                     int row_width, unsigned char flip, int tpgd);
+
+        void refine(const unsigned char *bits, int w, int h,
+                    const unsigned char *ref, int rw, int rh,
+                    int dx, int dy);
+
+        void integer(int cx, int v);
+
+        void symbol(int v);
+
+        void emit() {
+             if (bp >= 0)
+                 out[len++] = (unsigned char)b;
+        }
+
+        void byteout();
+
+        void renorm() {
+             do {
+                 a <<= 1;
+                 c <<= 1;
+                 if (--ct == 0)
+                     byteout();
+             } while ((a & 0x8000) == 0);
+        }
+
+        void code(int cx, int d);
+
+        void flush();
+};
+#endif
@@ -0,0 +1,185 @@
+//
+//
+// Copyright 2019 Richard P. Cornwell All Rights Reserved,
+//
+// The software is provided "as is", without warranty of any kind, express
+// or implied, including but not limited to the warranties of
+// merchantability, fitness for a particular purpose and non-infringement.
+// In no event shall Richard Cornwell be liable for any claim, damages
+// or other liability, whether in an action of contract, tort or otherwise,
+// arising from, out of or in connection with the software or the use or other
+// dealings in the software.
+//
+// Permission to use, copy, and distribute this software and its
+// documentation for non commercial use is hereby granted,
+// provided that the above copyright notice appear in all copies and that
+// both that copyright notice and this permission notice appear in
+// supporting documentation.
+//
+// The sale, resale, or use of this program for profit without the
+// express written consent of the author Richard Cornwell is forbidden.
+//
+// This program uses a XML control file to generate a PDF file. This is used
+// to convert listings and images into a more easy to read format. This program
+// is also capable of doing limited black and white processing to scanned images
+// to make them easier to read.
+
+// MD5 message digest, as given in RFC 1321.
+
+#include <string.h>
+#include "MD5.h"
+
+#define F(x, y, z)      (((x) & (y)) | (~(x) & (z)))
+#define G(x, y, z)      (((x) & (z)) | ((y) & ~(z)))
+#define H(x, y, z)      ((x) ^ (y) ^ (z))
+#define I(x, y, z)      ((y) ^ ((x) | ~(z)))
+#define ROL(x, n)       (((x) << (n)) | ((x) >> (32 - (n))))
+#define STEP(f, a, b, c, d, x, t, s) \
+        (a) += f((b), (c), (d)) + (x) + (t); \
+        (a) = ROL((a), (s)) + (b)
+
+void
+MD5::reset()
+{
+    state[0] = 0x67452301;
+    state[1] = 0xefcdab89;
+    state[2] = 0x98badcfe;
+    state[3] = 0x10325476;
+    count = 0;
+}
+
+// Hash one 64 byte block.
+void
+MD5::block(const unsigned char *p)
+{
+    uint32_t        x[16];
+    uint32_t        a, b, c, d;
+    int             i;
+
+    for (i = 0; i < 16; i++)
+        x[i] = p[i*4] | (p[i*4+1] << 8) | (p[i*4+2] << 16) |
+               ((uint32_t)p[i*4+3] << 24);
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+
+    STEP(F, a, b, c, d, x[ 0], 0xd76aa478,  7);
+    STEP(F, d, a, b, c, x[ 1], 0xe8c7b756, 12);
+    STEP(F, c, d, a, b, x[ 2], 0x242070db, 17);
+    STEP(F, b, c, d, a, x[ 3], 0xc1bdceee, 22);
+    STEP(F, a, b, c, d, x[ 4], 0xf57c0faf,  7);
+    STEP(F, d, a, b, c, x[ 5], 0x4787c62a, 12);
+    STEP(F, c, d, a, b, x[ 6], 0xa8304613, 17);
+    STEP(F, b, c, d, a, x[ 7], 0xfd469501, 22);
+    STEP(F, a, b, c, d, x[ 8], 0x698098d8,  7);
+    STEP(F, d, a, b, c, x[ 9], 0x8b44f7af, 12);
+    STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17);
+    STEP(F, b, c, d, a, x[11], 0x895cd7be, 22);
+    STEP(F, a, b, c, d, x[12], 0x6b901122,  7);
+    STEP(F, d, a, b, c, x[13], 0xfd987193, 12);
+    STEP(F, c, d, a, b, x[14], 0xa679438e, 17);
+    STEP(F, b, c, d, a, x[15], 0x49b40821, 22);
+
+    STEP(G, a, b, c, d, x[ 1], 0xf61e2562,  5);
+    STEP(G, d, a, b, c, x[ 6], 0xc040b340,  9);
+    STEP(G, c, d, a, b, x[11], 0x265e5a51, 14);
+    STEP(G, b, c, d, a, x[ 0], 0xe9b6c7aa, 20);
+    STEP(G, a, b, c, d, x[ 5], 0xd62f105d,  5);
+    STEP(G, d, a, b, c, x[10], 0x02441453,  9);
+    STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14);
+    STEP(G, b, c, d, a, x[ 4], 0xe7d3fbc8, 20);
+    STEP(G, a, b, c, d, x[ 9], 0x21e1cde6,  5);
+    STEP(G, d, a, b, c, x[14], 0xc33707d6,  9);
+    STEP(G, c, d, a, b, x[ 3], 0xf4d50d87, 14);
+    STEP(G, b, c, d, a, x[ 8], 0x455a14ed, 20);
+    STEP(G, a, b, c, d, x[13], 0xa9e3e905,  5);
+    STEP(G, d, a, b, c, x[ 2], 0xfcefa3f8,  9);
+    STEP(G, c, d, a, b, x[ 7], 0x676f02d9, 14);
+    STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20);
+
+    STEP(H, a, b, c, d, x[ 5], 0xfffa3942,  4);
+    STEP(H, d, a, b, c, x[ 8], 0x8771f681, 11);
+    STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16);
+    STEP(H, b, c, d, a, x[14], 0xfde5380c, 23);
+    STEP(H, a, b, c, d, x[ 1], 0xa4beea44,  4);
+    STEP(H, d, a, b, c, x[ 4], 0x4bdecfa9, 11);
+    STEP(H, c, d, a, b, x[ 7], 0xf6bb4b60, 16);
+    STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23);
+    STEP(H, a, b, c, d, x[13], 0x289b7ec6,  4);
+    STEP(H, d, a, b, c, x[ 0], 0xeaa127fa, 11);
+    STEP(H, c, d, a, b, x[ 3], 0xd4ef3085, 16);
+    STEP(H, b, c, d, a, x[ 6], 0x04881d05, 23);
+    STEP(H, a, b, c, d, x[ 9], 0xd9d4d039,  4);
+    STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11);
+    STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16);
+    STEP(H, b, c, d, a, x[ 2], 0xc4ac5665, 23);
+
+    STEP(I, a, b, c, d, x[ 0], 0xf4292244,  6);
+    STEP(I, d, a, b, c, x[ 7], 0x432aff97, 10);
+    STEP(I, c, d, a, b, x[14], 0xab9423a7, 15);
+    STEP(I, b, c, d, a, x[ 5], 0xfc93a039, 21);
+    STEP(I, a, b, c, d, x[12], 0x655b59c3,  6);
+    STEP(I, d, a, b, c, x[ 3], 0x8f0ccc92, 10);
+    STEP(I, c, d, a, b, x[10], 0xffeff47d, 15);
+    STEP(I, b, c, d, a, x[ 1], 0x85845dd1, 21);
+    STEP(I, a, b, c, d, x[ 8], 0x6fa87e4f,  6);
+    STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10);
+    STEP(I, c, d, a, b, x[ 6], 0xa3014314, 15);
+    STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21);
+    STEP(I, a, b, c, d, x[ 4], 0xf7537e82,  6);
+    STEP(I, d, a, b, c, x[11], 0xbd3af235, 10);
+    STEP(I, c, d, a, b, x[ 2], 0x2ad7d2bb, 15);
+    STEP(I, b, c, d, a, x[ 9], 0xeb86d391, 21);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+// Add data to the digest.
+void
+MD5::update(const void *data, unsigned long n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned int    have = count & 63;
+    unsigned int    k;
+
+    count += n;
+    if (have != 0) {
+        k = 64 - have;
+        if (k > n)
+            k = n;
+        memcpy(&buf[have], p, k);
+        p += k;
+        n -= k;
+        if (have + k < 64)
+            return;
+        block(buf);
+    }
+    for (; n >= 64; n -= 64, p += 64)
+        block(p);
+    memcpy(buf, p, n);
+}
+
+// Finish the digest, pad out the last block with the length in bits.
+void
+MD5::final(unsigned char digest[16])
+{
+    unsigned char   pad[72];
+    uint64_t        bits = count << 3;
+    unsigned int    n;
+    int             i;
+
+    n = 64 - (count & 63);
+    if (n < 9)
+        n += 64;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[n - 8 + i] = bits >> (8 * i);
+    update(pad, n);
+    for (i = 0; i < 16; i++)
+        digest[i] = state[i / 4] >> (8 * (i % 4));
+}
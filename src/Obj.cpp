@@ -300,6 +300,18 @@ Obj::close()
     file->put(">>endobj\n");
 }
 
+// Write an object that is only a number, such as the length of a stream
+// that was not known when the stream was started.
+void
+Obj::putNumber(int v)
+{
+    offset = file->get_offset();
+    put(number);
+    put(" 0 obj ");
+    put(v);
+    put("\nendobj\n");
+}
+
 // Refer to an object by name.
 void
 Obj::ref(const char *title)
@@ -53,7 +53,7 @@
 
 #ifndef _OBJ_H_
 #define _OBJ_H_
-#define HDR     "%PDF-1.3\n\n%\305\324\234\234\n\n"
+#define HDR     "%PDF-1.4\n\n%\305\324\234\234\n\n"
 
 class Obj;
 class ObjList;
@@ -198,6 +198,8 @@ public:
 
         void close();
 
+        void putNumber(int v);
+
         void ref(const char *title = NULL);
 
         void put(const char *str);
@@ -31,6 +31,12 @@
 #include <time.h> 
 #include <png.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "Obj.h"
 #include "PDFFile.h"
@@ -38,9 +44,16 @@
 #include "Page.h"
 #include "Image.h"
 #include "Annot.h"
+#include "SHA256.h"
 
 
 extern int      verbose;
+extern int      max_dpi;
+extern char     *cache_dir;
+
+// Change when images are written differently, so old cache files are
+// not used.
+#define CACHE_VERSION   4
 
 // Create new object for this file.
 Obj
@@ -58,7 +71,7 @@ PDFfile::open(char *fname)
 {
     name = new char[strlen(fname)+1];
     strcpy(name, fname);
-    file = fopen(name, "w");
+    file = fopen(name, "w+");
     if (file == 0)
         return 1;
     put(HDR);
@@ -70,6 +83,10 @@ void
 PDFfile::addSection(char *title)
 {
      Obj        *t;
+
+     // Symbols found before the first page are for that page's section.
+     if (cur_sect != 0 && syms != 0)
+         putSyms();
      t = newObj(0);
      cur_sect = new Section(title, t);
      sects->add(cur_sect);
@@ -109,12 +126,12 @@ Page
 
 // New stream object.
 Stream
-*PDFfile::newStream()
+*PDFfile::newStream(Arena *arena)
 {
      Obj        *s;
 
      s = newObj(0);
-     return new Stream(s);
+     return new Stream(s, arena);
 }
 
 // Set title of PDF file.
@@ -211,7 +228,8 @@ PDFfile::put(int v)
     p = buffer;
     *p++ = '\0';
     if (v < 0) {
-        *p++ = '-';
+        fputc('-', file);
+        offset++;
         v = -v;
     }
     do {
@@ -242,6 +260,9 @@ PDFfile::close()
     ObjList     *pages;
     int         xrefoffset;
 
+    if (syms != 0)
+        putSyms();
+
     // First place all pages into file.
     if (port_pages != 0 && land_pages != 0) {
         o = newObj(0);
@@ -266,6 +287,13 @@ PDFfile::close()
         pages = land_pages;
     }
 
+    if (verbose && img_hits != 0)
+        fprintf(stderr, "%d images shared\n", img_hits);
+    if (verbose && cache_hits != 0)
+        fprintf(stderr, "%d images from cache\n", cache_hits);
+    if (verbose && file_hits != 0)
+        fprintf(stderr, "%d files shared\n", file_hits);
+
     // Create the Outline.
     sects->put();
     cat = newObj(0);
@@ -341,7 +369,7 @@ PDFfile::convertFile(char *name, int lpp, int land)
             buffer[0] = '1';
         if (blank_title) {
             if (strm == 0) {
-                strm = newStream();
+                strm = newStream(&page_arena);
                 page = newPage(land);
                 strm->appendCmd("BT\n/FF 10 Tf ");
                 if (land) 
@@ -361,6 +389,7 @@ PDFfile::convertFile(char *name, int lpp, int land)
             page->open();
             page->close();
             delete strm;
+            page_arena.reset();
             strm = 0;
         }
         if (buffer[0] == '1' && buffer[1] == '\0') {
@@ -368,7 +397,7 @@ PDFfile::convertFile(char *name, int lpp, int land)
         } else {
             // Allocate a new stream
             if (strm == 0) {
-                strm = newStream();
+                strm = newStream(&page_arena);
                 page = newPage(land);
                 strm->appendCmd("BT\n /FF 10 Tf ");
                 if (land) 
@@ -408,6 +437,7 @@ PDFfile::convertFile(char *name, int lpp, int land)
         page->open();
         page->close();
         delete strm;
+        page_arena.reset();
     }
     fclose(f);
     return;
@@ -422,121 +452,489 @@ struct  unline {
         struct unline *next;
 };
 
-// Convert a text file into PDF with limited formating codes.
-void
-PDFfile::convertText(char *name)
+// Map a whole file into memory, or read it in if it can't be mapped.
+// Returns 0 on error, size gets the length. Free with unmap_file.
+static char *
+map_file(const char *name, size_t *size, int *mapped)
+{
+    struct stat     st;
+    char            *buf, *n;
+    size_t          len, got;
+    ssize_t         r;
+    int             fd;
+
+    *size = 0;
+    *mapped = 0;
+    fd = ::open(name, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        buf = (char *)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf != (char *)MAP_FAILED) {
+            madvise(buf, st.st_size, MADV_SEQUENTIAL);
+            ::close(fd);
+            *size = st.st_size;
+            *mapped = 1;
+            return buf;
+        }
+    }
+    len = 65536;
+    got = 0;
+    buf = new char[len];
+    while ((r = read(fd, &buf[got], len - got)) > 0) {
+        got += r;
+        if (got == len) {
+            n = new char[len * 2];
+            memcpy(n, buf, got);
+            delete[] buf;
+            buf = n;
+            len *= 2;
+        }
+    }
+    ::close(fd);
+    if (r < 0) {
+        delete[] buf;
+        return 0;
+    }
+    *size = got;
+    return buf;
+}
+
+static void
+unmap_file(char *buf, size_t size, int mapped)
+{
+    if (mapped)
+        munmap(buf, size);
+    else
+        delete[] buf;
+}
+
+// Bytes of a text line that need more than a copy.
+static inline int
+text_special(unsigned char c)
+{
+    return c == '(' || c == ')' || c == '\t' || c == '<' || c == '\\' ||
+           c == '\f';
+}
+
+// Find the next special byte from p up to end, 16 bytes at a time.
+static const char *
+text_scan(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    __m128i     lp = _mm_set1_epi8('(');
+    __m128i     rp = _mm_set1_epi8(')');
+    __m128i     tab = _mm_set1_epi8('\t');
+    __m128i     lt = _mm_set1_epi8('<');
+    __m128i     bs = _mm_set1_epi8('\\');
+    __m128i     ff = _mm_set1_epi8('\f');
+    __m128i     v, m;
+    int         bits;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lp),
+                                      _mm_cmpeq_epi8(v, rp)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                      _mm_cmpeq_epi8(v, lt)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, bs),
+                                         _mm_cmpeq_epi8(v, ff)));
+        bits = _mm_movemask_epi8(m);
+        if (bits != 0)
+            return p + __builtin_ctz(bits);
+    }
+#endif
+    while (p < end && !text_special(*p))
+        p++;
+    return p;
+}
+
+// Add text to the string being shown, starting one if needed.
+static void
+text_put(Stream *strm, int *shown, const char *s, int n)
 {
-    char    buffer[1000];
-    char    out[1000];
-    char    *p, *q;
+    if (!*shown) {
+        strm->appendData(" (", 2);
+        *shown = 1;
+    }
+    strm->appendData(s, n);
+}
+
+// Show the string being built, if there is one.
+static void
+text_show(Stream *strm, int *shown, const char *cmd)
+{
+    if (*shown) {
+        strm->appendData(") ", 2);
+        strm->appendCmd(cmd);
+        *shown = 0;
+    }
+}
+
+// Find where a line ends once trailing blanks are dropped.
+static const char *
+text_trim(const char *p, const char *le)
+{
+    int     i;
+
+    for (i = (le - p) - 1; i >= 0 && p[i] == ' ' && i != 1; i--)
+        ;
+    return p + i + 1;
+}
+
+// Gather a name for \A or \I up to its closing escape, or the end of the
+// line. Returns 1 if the closing escape was found, p is left on its \.
+static int
+text_collect(const char **pp, const char *r, char collect, char **name,
+             int *len, int *size)
+{
+    const char *p = *pp;
+    const char *s = p;
+
+    while (p < r && !(*p == '\\' && p + 1 < r && p[1] == collect))
+        p++;
+    if (*len + (p - s) + 1 > *size) {
+        char    *n;
+
+        *size = 2 * (*len + (p - s) + 1);
+        n = new char[*size];
+        memcpy(n, *name, *len);
+        delete[] *name;
+        *name = n;
+    }
+    memcpy(&(*name)[*len], s, p - s);
+    *len += p - s;
+    (*name)[*len] = '\0';
+    *pp = p;
+    return p != r;
+}
+
+// Image placed by \I..\i, loaded before the pages are laid out since
+// its size moves the text after it.
+struct text_img {
+    Obj             *obj;           // 0 if it could not be loaded.
+    int             w, h;
+    struct text_img *next;
+};
+
+// Attachment placed on a page by \A..\a.
+struct text_ref {
+    char            *name;
+    int             x, y;
+    struct text_ref *next;
+};
+
+// Page laid out and compressed, waiting to be put in the file.
+struct text_page {
+    Stream          *strm;          // Contents, no object yet.
+    Resource        res;
+    struct text_ref *refs;          // In the order they were placed.
+    struct text_page *next;
+};
+
+// Form feed pages of a text file laid out together. Nothing but the
+// baseline offset is carried from one job to the next.
+struct text_job {
+    PDFfile         *file;
+    const char      *start;         // First byte of the job.
+    const char      *end;           // End of the text.
+    const char      *first;         // End of the line start is in.
+    const char      *brk;           // Form feed ending the job, or 0.
+    int             mid;            // start is part way into a line.
+    int             offset;         // Baseline offset at start.
+    int             seq;
+    int             done;
+    Arena           *arena;         // For the pages until written.
+    struct text_img *imgs;          // Images in the order used.
+    struct text_page *pages, *lpage;
+    struct text_job *next;
+};
+
+static struct text_job *
+text_newjob(PDFfile *file, const char *start, const char *end, int seq)
+{
+    struct text_job *j = new struct text_job;
+
+    memset(j, 0, sizeof(struct text_job));
+    j->file = file;
+    j->start = start;
+    j->end = end;
+    j->seq = seq;
+    return j;
+}
+
+// Split a text file into jobs at form feeds and load the images it uses.
+// This only follows what changes the state carried over a form feed, the
+// layout is done later. No split is made inside an underline.
+static struct text_job *
+text_split(PDFfile *file, const char *text, const char *end)
+{
+    struct text_job *jobs, *j;
+    struct text_img *ti, **lti;
+    const char *p, *le, *r;
+    char    *cname = 0;
+    int     clen = 0;
+    int     csize = 0;
+    char    collect = 0;
     int     offset = 0;
-    int     pos;
-    int     line;
-    struct  unline  *uline = 0, *ulst;
-    struct  unline  *image, *ilst;
-    FILE    *f;
+    int     uline = 0;              // Underline open.
+    int     ulined = 0;             // Underline finished on the page.
+
+    jobs = j = text_newjob(file, text, end, 0);
+    lti = &j->imgs;
+    for (p = text; p < end; p = le + 1) {
+        le = (const char *)memchr(p, '\n', end - p);
+        if (le == NULL)
+            le = end;
+        r = text_trim(p, le);
+        clen = 0;
+        while (p < r) {
+            if (collect != 0) {
+                if (!text_collect(&p, r, collect, &cname, &clen, &csize))
+                    break;
+                collect = 0;
+            } else if ((p = text_scan(p, r)) == r)
+                break;
+            switch(*p) {
+            case '<':
+                       while(++p < r && *p != '>') 
+                           ;
+                       if (p == r)
+                           p--;
+                       break;
+            case '\\':
+                       if (++p == r)
+                           break;
+                       switch(*p) {
+                       case 'A':
+                       case 'I':
+                            collect = *p - 'A' + 'a';
+                            clen = 0;
+                            break;
+                       case 'a':
+                            clen = 0;
+                            break;
+                       case 'U':
+                            uline = 1;
+                            break;
+                       case 'u':
+                            if (uline)
+                                ulined = 1;
+                            uline = 0;
+                            break;
+                       case 'S':
+                            if (offset == 0)
+                                offset = 5;
+                            else if (offset == -5)
+                                offset = 0;
+                            break;
+                       case 's':
+                            if (offset == 0)
+                                offset = -5;
+                            else if (offset == 5)
+                                offset = 0;
+                            break;
+                       case 'i':
+                            if (clen == 0)
+                                break;
+                            clen = 0;
+                            ti = new struct text_img;
+                            ti->next = 0;
+                            *lti = ti;
+                            lti = &ti->next;
+                            ti->obj = file->textImage(cname, &ti->w, &ti->h);
+                            break;
+                       }
+                       break;
+            case '\f':
+                       if (ulined)
+                           uline = 0;
+                       ulined = 0;
+                       if (uline)
+                           break;
+                       j->brk = p;
+                       j->next = text_newjob(file, p + 1, end, j->seq + 1);
+                       j = j->next;
+                       j->first = r;
+                       j->mid = 1;
+                       j->offset = offset;
+                       lti = &j->imgs;
+                       break;
+            }
+            p++;
+        }
+    }
+    delete[] cname;
+    return jobs;
+}
+
+// Finish off a page and put it on the job.
+static void
+text_finish(struct text_job *j, struct text_page *pg, struct unline *ulst,
+            struct unline *ilst)
+{
+    Stream  *strm = pg->strm;
+    struct unline *u;
+    char    out[100];
+
+    strm->appendCmd("ET\n");
+    if (ulst) {
+        strm->appendCmd("0 g q 1 0 0 1 0 0 cm\n");
+        while(ulst != 0) {
+            u = ulst->next;
+            strm->appendPoint(ulst->sx, ulst->sy);
+            strm->appendCmd(" m ");
+            strm->appendPoint(ulst->ex, ulst->ey);
+            strm->appendCmd(" l S\n");
+            ulst = u;
+        }
+        strm->appendCmd("Q\n");
+    }
+    if (ilst) {
+        strm->appendCmd("0 g\n");
+        while(ilst != 0) {
+            u = ilst->next;
+            sprintf(out, "q %d 0 0 %d %d %d cm /Im%d Do Q\n",
+                  ilst->ey, ilst->ex, ilst->sx, ilst->sy, ilst->num);
+            strm->appendCmd(out);
+            ilst = u;
+        }
+    }
+    strm->compress();
+    pg->next = 0;
+    if (j->lpage)
+        j->lpage->next = pg;
+    else
+        j->pages = pg;
+    j->lpage = pg;
+}
+
+static struct text_page *
+text_newpage(struct text_job *j)
+{
+    struct text_page *pg = new struct text_page;
+
+    pg->strm = new Stream(0, j->arena);
+    pg->res.addFont1(j->file->font1);
+    pg->refs = 0;
+    pg->strm->appendCmd("BT\n/FF 10 Tf 12 TL 1 0 0 1 10 752 Tm");
+    return pg;
+}
+
+// Lay out the pages of one job. Only the job is touched, so this can be
+// run on any thread.
+static void
+text_layout(struct text_job *j)
+{
+    char    out[100];
+    const char *le, *p, *r;
+    char    *cname = 0;             // Name collected by \A or \I.
+    int     clen = 0;
+    int     csize = 0;
+    int     shown = 0;              // String started in strm.
+    int     offset = j->offset;
+    int     pos = 0;
+    int     line = 0;
+    struct  unline  *uline = 0, *ulst = 0;
+    struct  unline  *image, *ilst = 0;
+    struct  text_page *pg;
+    struct  text_ref *tr, **ltr;
+    struct  text_img *ti = j->imgs;
     Stream  *strm;
-    Resource res;
-    Page    *page;
     int     spacing = 12;
     char    collect = 0;
     int     i;
 
-    ulst = 0;
-    ilst = 0;
-    f = fopen(name, "r");
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open text %s\n", name);
-        return;
-    }
-    if (verbose)
-        fprintf(stderr, "Processing text %s\n", name);
-    strm = newStream();
-    page = newPage(0);
-    page->content(strm->obj);
-    res.addFont1(font1);
-    strm->appendCmd("BT\n/FF 10 Tf 12 TL 1 0 0 1 10 752 Tm");
-    line = 0;
-    pos = 0;
-    while(!feof(f)) {
-        if (fgets(buffer, sizeof(buffer), f) == NULL)
-            break;
-        p = strrchr(buffer, '\n');
-        if (p)
-            *p = '\0';
-        strm->appendCmd("\nT* ");
-        line+=spacing;
-        pos = 0;
-        /* Clear trailing blanks */
-        p = &buffer[strlen(buffer)-1];
-        while(*p == ' ' && p != &buffer[1]) p--;
-        *++p = '\0';
-        q = out;
-        for(p = buffer; *p != '\0'; p++) {
+    pg = text_newpage(j);
+    strm = pg->strm;
+    ltr = &pg->refs;
+    for (p = j->start; p < j->end || j->mid; p = le + 1) {
+        le = j->end;
+        if (p < le && (r = (const char *)memchr(p, '\n', le - p)) != NULL)
+            le = r;
+        if (j->mid) {
+            // Rest of the line the form feed was on.
+            r = j->first;
+            j->mid = 0;
+        } else {
+            strm->appendCmd("\nT* ");
+            line+=spacing;
+            pos = 0;
+            clen = 0;
+            r = text_trim(p, le);
+        }
+        while (p < r) {
             if (collect != 0) {
-                if (*p == '\\' && p[1] == collect) {
-                    collect = 0;
-                } else {
-                    *q++ = *p;
-                    continue;
+                if (!text_collect(&p, r, collect, &cname, &clen, &csize))
+                    break;
+                collect = 0;
+            } else {
+                const char *s = p;
+
+                p = text_scan(p, r);
+                if (p != s) {
+                    text_put(strm, &shown, s, p - s);
+                    pos += p - s;
                 }
+                if (p == r)
+                    break;
             }
             switch(*p) {
             case '(':
             case ')':
-                       *q++ = '\\';
-                       *q++ = *p;
+                       out[0] = '\\';
+                       out[1] = *p;
+                       text_put(strm, &shown, out, 2);
                        pos++;
                        break;
             case '\t':
                        i = (pos | 07) + 1;
-                       while(pos != i) {
-                           pos++;
-                           *q++ = ' ';
-                       }
+                       text_put(strm, &shown, "        ", i - pos);
+                       pos = i;
                        break;
             case '<':
                        i = 0;
-                       *q++ = '\0';
-                       if (out[0] != '\0') {
-                           strm->appendStr(out);
-                           strm->appendCmd("Tj ");
-                           q = out;
-                       }
-                       while(*++p != '>') 
+                       text_show(strm, &shown, "Tj ");
+                       while(++p < r && *p != '>') 
                            i = (i << 3) + (*p - '0');
                        sprintf(out, "/FS 10 Tf (\\%03o) Tj /FF 10 Tf", i);
                        strm->appendCmd(out);
-                       res.addFont2(font2);
+                       pg->res.addFont2(j->file->font2);
+                       if (p == r)
+                           p--;
                        break;
             case '\\':
-                       switch(*++p) {
+                       if (++p == r)
+                           break;
+                       switch(*p) {
                        case 'A':   // Imbed file
-                            *q++ = '\0';
-                            if (out[0] != '\0') {
-                                strm->appendStr(out);
-                                strm->appendCmd("Tj ");
-                                q = out;
-                            }
+                            text_show(strm, &shown, "Tj ");
                             collect = 'a';
+                            clen = 0;
                             break;
 
                        case 'a':
-                            *q++ = '\0';
-                            q = out;
-                            if (out[0] != '\0') {
-                                annots.ref(out, 10 + (pos * 6), 740 - line);
-                                if (p[1] != '\0') {
-                                    strcpy(out, "    ");
-                                    i = strlen(out);
-                                    q = &out[i];
-                                    pos += i;
+                            if (clen != 0) {
+                                tr = (struct text_ref *)
+                                        j->arena->alloc(sizeof(struct text_ref));
+                                tr->name = (char *)j->arena->alloc(clen + 1);
+                                strcpy(tr->name, cname);
+                                tr->x = 10 + (pos * 6);
+                                tr->y = 740 - line;
+                                tr->next = 0;
+                                *ltr = tr;
+                                ltr = &tr->next;
+                                clen = 0;
+                                if (p + 1 < r) {
+                                    text_put(strm, &shown, "    ", 4);
+                                    pos += 4;
                                 }
                             }
                             break;
                             
                        case 'U':   // Start underline
-                            uline = new unline;
+                            uline = (struct unline *)
+                                        j->arena->alloc(sizeof(struct unline));
                             uline->next = ulst;
                             uline->sx = 10 + (pos * 6);
                             uline->sy = 750 - line;
@@ -552,12 +950,7 @@ PDFfile::convertText(char *name)
                             break;
 
                        case 'l':   // Last line.
-                            *q++ = '\0';
-                            if (out[0] != '\0') {
-                                strm->appendStr(out);
-                                strm->appendCmd("Tj ");
-                            }
-                            q = out;
+                            text_show(strm, &shown, "Tj ");
                             pos = 0;
                             if (line < (58 * 12)) {
                                 sprintf(out, "%d TL T* %d TL ", (58*12) - line, spacing);
@@ -567,60 +960,35 @@ PDFfile::convertText(char *name)
                             break;
 
                        case 'H':   // Half space.
-                            *q++ = '\0';
-                            if (out[0] != '\0') {
-                                strm->appendStr(out);
-                                strm->appendCmd("Tj ");
-                            }
-                            q = out;
+                            text_show(strm, &shown, "Tj ");
                             pos = 0;
                             strm->appendCmd("6 TL ");
                             spacing = 6;
                             break;
 
                        case 'h':   // Line + half space.
-                            *q++ = '\0';
-                            if (out[0] != '\0') {
-                                strm->appendStr(out);
-                                strm->appendCmd("Tj ");
-                            }
-                            q = out;
+                            text_show(strm, &shown, "Tj ");
                             pos = 0;
                             strm->appendCmd("18 TL ");
                             spacing = 18;
                             break;
 
                        case 'D':   // Double space.
-                            *q++ = '\0';
-                            if (out[0] != '\0') {
-                                strm->appendStr(out);
-                                strm->appendCmd("Tj ");
-                                q = out;
-                            }
+                            text_show(strm, &shown, "Tj ");
                             pos = 0;
                             strm->appendCmd("24 TL ");
                             spacing = 24;
                             break;
 
                        case 'N':   // Normal space.
-                            *q++ = '\0';
-                            if (out[0] != '\0') {
-                                strm->appendStr(out);
-                                strm->appendCmd("Tj ");
-                            }
-                            q = out;
+                            text_show(strm, &shown, "Tj ");
                             pos = 0;
                             strm->appendCmd("12 TL ");
                             spacing = 12;
                             break;
 
                        case 'S':   // Superscript 
-                            *q++ = '\0';
-                            if (out[0] != '\0') {
-                                strm->appendStr(out);
-                                strm->appendCmd("Tj ");
-                                q = out;
-                            }
+                            text_show(strm, &shown, "Tj ");
                             if (offset == 0) {
                                 strm->appendCmd("5 Ts");
                                 offset = 5;
@@ -630,12 +998,7 @@ PDFfile::convertText(char *name)
                             }
                             break;
                        case 's':   // Subscript
-                            *q++ = '\0';
-                            if (out[0] != '\0') {
-                                strm->appendStr(out);
-                                strm->appendCmd("Tj ");
-                                q = out;
-                            }
+                            text_show(strm, &shown, "Tj ");
                             if (offset == 0) {
                                 strm->appendCmd("-5 Ts");
                                 offset = -5;
@@ -645,181 +1008,658 @@ PDFfile::convertText(char *name)
                             }
                             break;
                        case 'I':   // Image
-                            *q++ = '\0';
-                            if (out[0] != '\0') {
-                                strm->appendStr(out);
-                                strm->appendCmd("Tj ");
-                                q = out;
-                            }
+                            text_show(strm, &shown, "Tj ");
                             collect = 'i';
+                            clen = 0;
                             break;
                        case 'i':   // Output image.
-                            *q++ = '\0';
-                            q = out;
-                            if (out[0] != '\0') {
-                                Image *img = new Image;
-                                Stream  *is;
-                                int        h, w;
-                                if (!img->open((unsigned char *)out)) {
-                                   delete img;
-                                   break;
+                            if (clen != 0) {
+                                int     h, w;
+
+                                clen = 0;
+                                if (ti == 0 || ti->obj == 0) {
+                                    if (ti != 0)
+                                        ti = ti->next;
+                                    break;
                                 }
-                                is = newStream();
-                                res.addImage(img->save(is));
-                                w = img->d_width();
-                                h = img->d_height();
-                                image = new unline;
+                                w = ti->w;
+                                h = ti->h;
+                                if (!pg->res.imgs.in(ti->obj))
+                                    pg->res.addImage(ti->obj);
+                                image = (struct unline *)
+                                        j->arena->alloc(sizeof(struct unline));
                                 image->next = ilst;
                                 image->sx = 10 + (pos * 6);
                                 image->sy = 750 - line - h;
                                 image->ex = h;
                                 image->ey = w;
-                                image->num = is->obj->number;
+                                image->num = ti->obj->number;
+                                ti = ti->next;
                                 line += h;
                                 sprintf(out, "%d TL T* %d TL ", h, spacing);
                                 strm->appendCmd(out);
-                                if (p[1] != '\0') {
+                                if (p + 1 < r) {
                                     sprintf(out, "[( ) %d ] TJ ", w/6);
                                     strm->appendCmd(out);
                                 }
-                                delete is;
-                                delete img;
                                 ilst = image;
-                                image = 0;
                             }
                             break;
                        case '\'':  
                        case '>':   
                        case '<':   
-                           *q++ = *p;
+                           text_put(strm, &shown, p, 1);
                            pos++;
                        }
                        break;
             case '\f':
-                       *q++ = '\0';
-                       if (out[0] != '\0') {
-                           strm->appendStr(out);
-                           strm->appendCmd("Tj\n");
-                           q = out;
-                       }
-                       strm->appendCmd("ET\n");
-                       if (ulst) {
-                           strm->appendCmd("0 g q 1 0 0 1 0 0 cm\n");
-                           uline = ulst; 
-                           while(uline != 0) {
-                               struct unline  *u = uline->next;
-                               strm->appendPoint(uline->sx, uline->sy);
-                               strm->appendCmd(" m ");
-                               strm->appendPoint(uline->ex, uline->ey);
-                               strm->appendCmd(" l S\n");
-                               delete uline;
-                               uline = u;
-                           }
-                           ulst = 0;
+                       text_show(strm, &shown, "Tj\n");
+                       // An open underline is only kept if none were
+                       // finished on the page.
+                       if (ulst)
                            uline = 0;
-                           strm->appendCmd("Q\n");
-                       }
-                       if (ilst) {
-                           strm->appendCmd("0 g\n");
-                           image = ilst; 
-                           while(image != 0) {
-                               struct unline  *u = image->next;
-                               sprintf(out, "q %d 0 0 %d %d %d cm /Im%d Do Q\n",
-                                     image->ey, image->ex, image->sx, image->sy,
-                                     image->num);
-                               strm->appendCmd(out);
-                               delete image;
-                               image = u;
-                           }
-                           ilst = 0;
-                           image = 0;
+                       text_finish(j, pg, ulst, ilst);
+                       ulst = 0;
+                       ilst = 0;
+                       if (p == j->brk) {
+                           delete[] cname;
+                           return;
                        }
-                       strm->close();
-                       delete strm;
-                       annots.put(this);
-                       page->resource(res_cache.find(&res, this));
-                       page->open();
-                       page->close();
-                       res.clear();
-                       res.addFont1(font1);
-                       strm = newStream();
-                       page = newPage(0);
-                       page->content(strm->obj);
-                       strm->appendCmd("BT\n/FF 10 Tf 12 TL 1 0 0 1 10 752 Tm");
+                       pg = text_newpage(j);
+                       strm = pg->strm;
+                       ltr = &pg->refs;
                        spacing = 12;
                        pos = 0;
                        line = 0;
                        break;
-            default:
-                       *q++ = *p;
-                       pos++;
             }
+            p++;
         }
-        *q++ = '\0';
-        if (out[0] != '\0') {
-            strm->appendStr(out);
-            strm->appendCmd("Tj ");
-        }
+        text_show(strm, &shown, "Tj ");
         if (offset != 0)
             strm->appendCmd("0 Ts ");
     }
-    strm->appendCmd("ET\n");
-    if (ulst) {
-        strm->appendCmd("0 g q 1 0 0 1 0 0 cm\n");
-        uline = ulst; 
-        while(uline != 0) {
-            struct unline  *u = uline->next;
-            strm->appendPoint(uline->sx, uline->sy);
-            strm->appendCmd(" m ");
-            strm->appendPoint(uline->ex, uline->ey);
-            strm->appendCmd(" l S\n");
-            delete uline;
-            uline = u;
+    text_finish(j, pg, ulst, ilst);
+    delete[] cname;
+}
+
+// Threads laying out the jobs of a text file. They run a few jobs ahead
+// of the ones written, so finished pages don't pile up.
+struct text_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;           // A job was finished or written.
+    struct text_job *next;          // Next job to lay out.
+    int             written;        // Jobs put in the file.
+    int             ahead;          // Jobs allowed past written.
+    Arena           **idle;         // Arenas of jobs written.
+    int             nidle;
+};
+
+// Take the next job to lay out, with the lock held.
+static void
+text_take(struct text_pool *tp, struct text_job *j)
+{
+    tp->next = j->next;
+    if (tp->nidle > 0)
+        j->arena = tp->idle[--tp->nidle];
+    else
+        j->arena = new Arena;
+}
+
+static void *
+text_run(void *arg)
+{
+    struct text_pool *tp = (struct text_pool *)arg;
+    struct text_job *j;
+
+    for (;;) {
+        pthread_mutex_lock(&tp->lock);
+        while (tp->next != 0 && tp->next->seq >= tp->written + tp->ahead)
+            pthread_cond_wait(&tp->cond, &tp->lock);
+        j = tp->next;
+        if (j != 0)
+            text_take(tp, j);
+        pthread_mutex_unlock(&tp->lock);
+        if (j == 0)
+            break;
+        text_layout(j);
+        pthread_mutex_lock(&tp->lock);
+        j->done = 1;
+        pthread_cond_broadcast(&tp->cond);
+        pthread_mutex_unlock(&tp->lock);
+    }
+    return NULL;
+}
+
+// Load an image placed in a text file, or find it if already used.
+Obj *
+PDFfile::textImage(char *name, int *w, int *h)
+{
+    Obj     *is;
+    Image   *img;
+    char    *key = new char[strlen(name) + 3];
+
+    // Images used before are only referenced.
+    sprintf(key, "\\I%s", name);
+    is = findImage(key, name, w, h);
+    if (is == 0) {
+        img = new Image;
+        if (img->load((unsigned char *)name, max_dpi)) {
+            if (max_dpi)
+                img->downsample(max_dpi);
+            is = addImage(img, key);
+            *w = img->d_width();
+            *h = img->d_height();
         }
-        strm->appendCmd("Q\n");
+        delete img;
     }
-    if (ilst) {
-        strm->appendCmd("0 g\n");
-        image = ilst; 
-        while(image != 0) {
-            struct unline  *u = image->next;
-            sprintf(out, "q %d 0 0 %d %d %d cm /Im%d Do Q\n",
-                  image->ex, image->ey, image->sx, image->sy,
-                  image->num);
-            strm->appendCmd(out);
-            delete image;
-            image = u;
+    delete[] key;
+    return is;
+}
+
+// Convert a text file into PDF with limited formating codes.
+// The file is scanned for the few bytes that mean something, the runs
+// of text between them are copied as they are. Lines can be any length.
+// Pages split by form feeds are laid out and compressed on as many
+// threads as there are processors, then written in order.
+void
+PDFfile::convertText(char *name)
+{
+    char    *text;
+    size_t  size;
+    int     mapped;
+    struct  text_pool tp;
+    struct  text_job *jobs, *j, *nj;
+    struct  text_page *pg, *npg;
+    struct  text_ref *tr;
+    struct  text_img *ti, *nti;
+    pthread_t *tid;
+    Page    *page;
+    int     n, k;
+
+    text = map_file(name, &size, &mapped);
+    if (text == NULL) {
+        fprintf(stderr, "Unable to open text %s\n", name);
+        return;
+    }
+    if (verbose)
+        fprintf(stderr, "Processing text %s\n", name);
+    jobs = text_split(this, text, text + size);
+    for (n = 0, j = jobs; j != 0; j = j->next)
+        n++;
+    k = sysconf(_SC_NPROCESSORS_ONLN);
+    if (k > 16)
+        k = 16;
+    if (n > k)
+        n = k;
+    // This thread lays out jobs as well, when it is waiting for one.
+    n--;
+    pthread_mutex_init(&tp.lock, NULL);
+    pthread_cond_init(&tp.cond, NULL);
+    tp.next = jobs;
+    tp.written = 0;
+    tp.ahead = 4 * (n + 1);
+    tp.idle = new Arena *[tp.ahead + 1];
+    tp.nidle = 0;
+    tid = new pthread_t[n > 0 ? n : 1];
+    for (k = 0; k < n; k++) {
+        if (pthread_create(&tid[k], NULL, text_run, &tp) != 0)
+            break;
+    }
+    n = k;
+    for (j = jobs; j != 0; j = nj) {
+        pthread_mutex_lock(&tp.lock);
+        if (tp.next == j) {
+            text_take(&tp, j);
+            pthread_mutex_unlock(&tp.lock);
+            text_layout(j);
+        } else {
+            while (!j->done)
+                pthread_cond_wait(&tp.cond, &tp.lock);
+            pthread_mutex_unlock(&tp.lock);
+        }
+        for (pg = j->pages; pg != 0; pg = npg) {
+            pg->strm->obj = newObj(0);
+            page = newPage(0);
+            page->content(pg->strm->obj);
+            pg->strm->close();
+            delete pg->strm;
+            for (tr = pg->refs; tr != 0; tr = tr->next)
+                annots.ref(tr->name, tr->x, tr->y);
+            annots.put(this);
+            page->resource(res_cache.find(&pg->res, this));
+            page->open();
+            page->close();
+            npg = pg->next;
+            delete pg;
         }
-        ilst = 0;
-        image = 0;
+        for (ti = j->imgs; ti != 0; ti = nti) {
+            nti = ti->next;
+            delete ti;
+        }
+        nj = j->next;
+        j->arena->reset();
+        pthread_mutex_lock(&tp.lock);
+        tp.idle[tp.nidle++] = j->arena;
+        delete j;
+        tp.written++;
+        pthread_cond_broadcast(&tp.cond);
+        pthread_mutex_unlock(&tp.lock);
+    }
+    for (k = 0; k < n; k++)
+        pthread_join(tid[k], NULL);
+    delete[] tid;
+    while (tp.nidle > 0)
+        delete tp.idle[--tp.nidle];
+    delete[] tp.idle;
+    pthread_mutex_destroy(&tp.lock);
+    pthread_cond_destroy(&tp.cond);
+    unmap_file(text, size, mapped);
+}
+
+// Find a file already included with the same size and type, and if md5
+// is given the same contents. gunzip is set if the stream holds the data
+// of a gzip file rather than the file.
+Obj
+*PDFfile::findFile(off_t size, int mode, const unsigned char *md5,
+                   int *gunzip)
+{
+    struct filelink *l;
+
+    for (l = files; l != 0; l = l->next) {
+        if (l->size != size || l->mode != mode)
+            continue;
+        if (md5 == 0)
+            return l->obj;
+        if (memcmp(l->md5, md5, 16) == 0) {
+            file_hits++;
+            if (gunzip)
+                *gunzip = l->gunzip;
+            return l->obj;
+        }
+    }
+    return 0;
+}
+
+// Remember a file that was included.
+void
+PDFfile::addFile(off_t size, int mode, const unsigned char *md5, Obj *obj,
+                 int gunzip)
+{
+    struct filelink *l = new struct filelink;
+
+    l->size = size;
+    l->mode = mode;
+    memcpy(l->md5, md5, 16);
+    l->obj = obj;
+    l->gunzip = gunzip;
+    l->next = files;
+    files = l;
+}
+
+// Find the image already written for key, and its size on the page in w
+// and h. Failing that, when there is a cache the image made from file
+// fname with key may be in there.
+Obj
+*PDFfile::findImage(const char *key, const char *fname, int *w, int *h)
+{
+    struct imglink  *l;
+    FILE            *f;
+    char            *buf;
+    uint64_t        hash;
+    int             size[2];
+    int64_t         src[2];
+    char            hdr[40];
+    long            n;
+    int             k;
+    Obj             *o;
+
+    delete[] cache_name;
+    cache_name = 0;
+    for (l = (img_tsize != 0) ? img_keys[keySlot(key)] : 0; l != 0;
+                 l = l->knext) {
+        if (l->key != 0 && strcmp(l->key, key) == 0) {
+            img_hits++;
+            if (w != 0) {
+                *w = l->w;
+                *h = l->h;
+            }
+            return l->obj;
+        }
+    }
+    if (cache_dir == 0 || fname == 0)
+        return 0;
+    cacheKey(key, fname);
+    if (cache_name == 0 || (f = fopen(cache_name, "r")) == 0)
+        return 0;
+    // The file starts with the image hash, the size and time of the file
+    // it was made from, and its size on the page.
+    fseek(f, 0, SEEK_END);
+    n = ftell(f) - sizeof(hash) - sizeof(src) - sizeof(size);
+    rewind(f);
+    if (n <= 0 || fread(&hash, sizeof(hash), 1, f) != 1 ||
+            fread(src, sizeof(src), 1, f) != 1 ||
+            src[0] != cache_src[0] || src[1] != cache_src[1] ||
+            fread(size, sizeof(size), 1, f) != 1) {
+        fclose(f);
+        return 0;
+    }
+    buf = new char[n];
+    if (fread(buf, 1, n, f) != (size_t)n || n < 17 ||
+            memcmp(&buf[n - 17], "endstream\nendobj\n", 17) != 0) {
+        fclose(f);
+        delete[] buf;
+        return 0;
     }
-    strm->close();
-    annots.put(this);
-    page->content(strm->obj);
-    page->resource(res_cache.find(&res, this));
-    page->open();
-    page->close();
-    delete strm;
     fclose(f);
-    return;
+    // The file holds the object as it was written after its number, it
+    // can only stand for one already written if that is the same.
+    for (l = (img_tsize != 0) ? img_hash[hash & (img_tsize - 1)] : 0; l != 0;
+                 l = l->hnext) {
+        if (l->hash != hash)
+            continue;
+        k = sprintf(hdr, "%d 0 obj <<", l->obj->number);
+        if (l->len - k == n && sameBytes(l, k, buf, n))
+            break;
+    }
+    if (l != 0) {
+        img_hits++;
+        o = l->obj;
+        n = l->len;
+    } else {
+        // The file holds the object as it was written, after its number.
+        o = newObj(0);
+        o->open();
+        o->putdata(buf, n);
+        n = offset - o->get_offset();
+        cache_hits++;
+    }
+    delete[] buf;
+    l = new struct imglink;
+    l->hash = hash;
+    l->key = new char[strlen(key) + 1];
+    strcpy(l->key, key);
+    l->obj = o;
+    l->len = n;
+    l->globals = 0;
+    l->w = size[0];
+    l->h = size[1];
+    if (w != 0) {
+        *w = l->w;
+        *h = l->h;
+    }
+    imgAdd(l);
+    delete[] cache_name;
+    cache_name = 0;
+    return o;
+}
+
+// Name the cache file for the image made from the file fname with key.
+// The name is the SHA-256 of the file, the key and the settings that
+// change how images are written. The size and time of the file are kept
+// to be checked against the entry.
+void
+PDFfile::cacheKey(const char *key, const char *fname)
+{
+    FILE            *f;
+    char            buf[65536];
+    unsigned char   sum[32];
+    size_t          n;
+    int             v = CACHE_VERSION;
+    int             i;
+    SHA256          sha;
+    struct stat     st;
+
+    f = fopen(fname, "r");
+    if (f == 0)
+        return;
+    if (fstat(fileno(f), &st) != 0) {
+        fclose(f);
+        return;
+    }
+    cache_src[0] = st.st_size;
+    cache_src[1] = st.st_mtime;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        sha.update(buf, n);
+    fclose(f);
+    // The key ends with a 0, so it can't run into what follows.
+    sha.update(key, strlen(key) + 1);
+    sha.update(&v, sizeof(v));
+    sha.update(&max_dpi, sizeof(max_dpi));
+    sha.final(sum);
+    cache_name = new char[strlen(cache_dir) + 66];
+    n = sprintf(cache_name, "%s/", cache_dir);
+    for (i = 0; i < 32; i++)
+        n += sprintf(&cache_name[n], "%02x", sum[i]);
+}
+
+// Copy the object for an image from the PDF file into the cache file
+// named by findImage. The file is written under another name first, so
+// other runs never see part of it.
+void
+PDFfile::cacheSave(struct imglink *l)
+{
+    FILE            *f;
+    char            hdr[40];
+    char            *tmp;
+    char            *buf;
+    int             hl, n;
+
+    hl = sprintf(hdr, "%d 0 obj <<", l->obj->number);
+    n = l->len - hl;
+    if (n <= 0)
+        return;
+    buf = new char[n];
+    fflush(file);
+    if (pread(fileno(file), buf, n, l->obj->get_offset() + hl) != n) {
+        delete[] buf;
+        return;
+    }
+    tmp = new char[strlen(cache_name) + 20];
+    sprintf(tmp, "%s.%d", cache_name, (int)getpid());
+    f = fopen(tmp, "w");
+    if (f != 0) {
+        int     size[2];
+
+        size[0] = l->w;
+        size[1] = l->h;
+        if (fwrite(&l->hash, sizeof(l->hash), 1, f) == 1 &&
+                fwrite(cache_src, sizeof(cache_src), 1, f) == 1 &&
+                fwrite(size, sizeof(size), 1, f) == 1 &&
+                fwrite(buf, 1, n, f) == (size_t)n && fclose(f) == 0)
+            rename(tmp, cache_name);
+        else
+            unlink(tmp);
+    }
+    delete[] tmp;
+    delete[] buf;
+}
+
+// Write an image into the file, unless one the same has already been.
+// Key names how the image was made, for findImage. The hash of the image
+// only picks out ones that may be the same, those are only used if the
+// data they were written with matches, and for JBIG2 text the symbols it
+// refers to.
+Obj
+*PDFfile::addImage(Image *img, const char *key)
+{
+    struct imglink  *l;
+    Stream          *strm = 0;
+    uint64_t        h;
+    Obj             *o = 0;
+    Obj             *g = 0;
+    int             len;
+    int             how = 0;
+
+    h = img->hash();
+    if (syms != 0 && syms->full())
+        putSyms();
+    if (syms == 0)
+        syms = new JBIG2Syms;
+    for (l = (img_tsize != 0) ? img_hash[h & (img_tsize - 1)] : 0; l != 0;
+                 l = l->hnext) {
+        if (l->hash != h)
+            continue;
+        if (strm == 0) {
+            strm = new Stream(0);
+            how = img->encode(strm, syms);
+            strm->compress();
+        }
+        // Text is only the same with the same symbols.
+        if ((how & ENC_SYMS) ? (syms->obj == 0 || l->globals != syms->obj)
+                             : l->globals != 0)
+            continue;
+        // The data comes last, before endstream and endobj.
+        if (sameBytes(l, l->len - 17 - strm->packedSize(),
+                      strm->packedData(), strm->packedSize())) {
+            img_hits++;
+            o = l->obj;
+            g = l->globals;
+            break;
+        }
+    }
+    if (o != 0) {
+        delete strm;
+        if (key == 0)
+            return o;
+        len = l->len;
+    } else {
+        if (strm == 0) {
+            strm = new Stream(0);
+            how = img->encode(strm, syms);
+        }
+        strm->obj = newObj(0);
+        if ((how & ENC_SYMS) && syms->obj == 0)
+            syms->obj = newObj(0);
+        if (how & ENC_SYMS)
+            g = syms->obj;
+        o = img->save(strm, how, syms);
+        delete strm;
+        len = offset - o->get_offset();
+    }
+    l = new struct imglink;
+    l->hash = h;
+    l->key = 0;
+    if (key != 0) {
+        l->key = new char[strlen(key) + 1];
+        strcpy(l->key, key);
+    }
+    l->obj = o;
+    l->len = len;
+    l->globals = g;
+    l->w = img->d_width();
+    l->h = img->d_height();
+    imgAdd(l);
+    if (key != 0 && cache_name != 0) {
+        // Text needs the symbols of this section, it is no use to a later
+        // run.
+        if (!(how & ENC_SYMS))
+            cacheSave(l);
+        delete[] cache_name;
+        cache_name = 0;
+    }
+    return o;
+}
+
+// Write the symbols of the images in this section, as their JBIG2Globals.
+void
+PDFfile::putSyms()
+{
+    JBIG2           jb;
+    Stream          *strm;
+
+    if (syms->obj != 0) {
+        jb.dict(syms);
+        strm = new Stream(syms->obj);
+        strm->appendData((char *)jb.out, jb.len);
+        strm->close();
+        delete strm;
+        if (verbose)
+            fprintf(stderr, "%d symbols\n", syms->count);
+    }
+    delete syms;
+    syms = 0;
+}
+
+// Slot in img_keys for key.
+unsigned int
+PDFfile::keySlot(const char *key)
+{
+    return Image::hashBytes(0, key, strlen(key)) & (img_tsize - 1);
+}
+
+// Remember an image written, in the list and both tables. The tables
+// grow to keep the chains short.
+void
+PDFfile::imgAdd(struct imglink *l)
+{
+    struct imglink  *p;
+    unsigned int    i;
+
+    l->next = images;
+    images = l;
+    if (++img_count > img_tsize) {
+        delete[] img_hash;
+        delete[] img_keys;
+        img_tsize = (img_tsize == 0) ? 64 : img_tsize * 2;
+        img_hash = new struct imglink *[img_tsize];
+        img_keys = new struct imglink *[img_tsize];
+        memset(img_hash, 0, img_tsize * sizeof(struct imglink *));
+        memset(img_keys, 0, img_tsize * sizeof(struct imglink *));
+        for (p = images; p != 0; p = p->next) {
+            i = p->hash & (img_tsize - 1);
+            p->hnext = img_hash[i];
+            img_hash[i] = p;
+            p->knext = 0;
+            if (p->key != 0) {
+                i = keySlot(p->key);
+                p->knext = img_keys[i];
+                img_keys[i] = p;
+            }
+        }
+        return;
+    }
+    i = l->hash & (img_tsize - 1);
+    l->hnext = img_hash[i];
+    img_hash[i] = l;
+    l->knext = 0;
+    if (l->key != 0) {
+        i = keySlot(l->key);
+        l->knext = img_keys[i];
+        img_keys[i] = l;
+    }
+}
+
+// Check that the n bytes in buf are in the file at off bytes into the
+// object of l.
+int
+PDFfile::sameBytes(struct imglink *l, long off, const char *buf, long n)
+{
+    char            *fbuf;
+    int             same;
+
+    if (off < 0 || off + n > l->len)
+        return 0;
+    fflush(file);
+    fbuf = new char[n];
+    same = pread(fileno(file), fbuf, n, l->obj->get_offset() + off) == n &&
+           memcmp(fbuf, buf, n) == 0;
+    delete[] fbuf;
+    return same;
 }
 
 // Convert an image into PDF file.
 void
-PDFfile::convertImage(char *name, Image *img, int land)
+PDFfile::convertImage(char *name, Obj *img_obj, int land)
 {
     Stream          *strm;
-    Obj             *img_obj;
     Page            *page;
     Resource        res;
     char            buffer[100];
 
-    strm = newStream();
-    img_obj = img->save(strm);
-    delete strm;
     page = newPage(land);
     res.addImage(img_obj);
-    strm = newStream();
+    strm = newStream(&page_arena);
     if (land) 
         sprintf(buffer, "q 792 0 0 612 0 0 cm /Im%d Do Q\n",
             img_obj->number);
@@ -844,6 +1684,7 @@ PDFfile::convertImage(char *name, Image *img, int land)
     page->open();
     page->close();
     delete strm;
+    page_arena.reset();
 }
 
 
@@ -28,6 +28,9 @@
 #include "Obj.h"
 #include "Image.h"
 #include "Annot.h"
+#include "Arena.h"
+
+#include <sys/types.h>
 
 #ifndef _PDFFILE_H_
 #define _PDFFILE_H_
@@ -48,6 +51,53 @@ class PDFfile {
         Pages           *port_pages;
         Pages           *land_pages;
         Page            *cur_page;
+        struct imglink {
+             uint64_t           hash;   // Hash of the image as saved.
+             char               *key;   // File and operations, or 0.
+             Obj                *obj;
+             int                len;    // Size of the object in the file.
+             Obj                *globals;       // JBIG2Globals of text,
+                                                // or 0.
+             int                w, h;   // Size of the image on the page.
+             struct imglink     *next;
+             struct imglink     *hnext; // Same slot in img_hash.
+             struct imglink     *knext; // Same slot in img_keys.
+        }               *images;        // Images already in the file.
+        struct imglink  **img_hash;     // Images by hash.
+        struct imglink  **img_keys;     // Images by key.
+        unsigned int    img_tsize;      // Slots in each table.
+        unsigned int    img_count;
+        int             img_hits;       // Images that were shared.
+        JBIG2Syms       *syms;          // Symbols of the images in this
+                                        // section.
+        char            *cache_name;    // Cache file for the image being
+                                        // made.
+        int             cache_hits;     // Images read from the cache.
+        int64_t         cache_src[2];   // Size and time of the file the
+                                        // image in the cache is made from.
+        struct filelink {
+             off_t              size;
+             int                mode;   // Binary or ascii.
+             unsigned char      md5[16];
+             Obj                *obj;   // EmbeddedFile stream.
+             int                gunzip; // Holds the data of a gzip file.
+             struct filelink    *next;
+        }               *files;         // Files already included.
+        int             file_hits;      // Files included more than once.
+        Arena           page_arena;     // Buffers of the page being built.
+
+        void    putSyms();
+
+        void    cacheKey(const char *key, const char *fname);
+
+        void    cacheSave(struct imglink *l);
+
+        void    imgAdd(struct imglink *l);
+
+        unsigned int keySlot(const char *key);
+
+        int     sameBytes(struct imglink *l, long off, const char *buf,
+                          long n);
 public:
         Obj             *font1, *font2;
         ResList res_cache;
@@ -62,12 +112,40 @@ public:
             port_pages = 0;
             land_pages = 0;
             cur_page = 0;
+            images = 0;
+            img_hash = 0;
+            img_keys = 0;
+            img_tsize = 0;
+            img_count = 0;
+            img_hits = 0;
+            syms = 0;
+            cache_name = 0;
+            cache_hits = 0;
+            cache_src[0] = cache_src[1] = 0;
+            files = 0;
+            file_hits = 0;
         }
 
         ~PDFfile() {
+            struct imglink *l;
             if (file)
                 fclose(file);
             delete[] name;
+            delete[] cache_name;
+            while (images != 0) {
+                l = images->next;
+                delete[] images->key;
+                delete images;
+                images = l;
+            }
+            delete[] img_hash;
+            delete[] img_keys;
+            delete syms;
+            while (files != 0) {
+                struct filelink *fl = files->next;
+                delete files;
+                files = fl;
+            }
         }
 
         Obj     *newObj(int array = 0);
@@ -82,7 +160,7 @@ public:
 
         Page *newPage(int land);
 
-        Stream *newStream();
+        Stream *newStream(Arena *arena = 0);
 
         void title(const char *str);
 
@@ -110,7 +188,20 @@ public:
 
         void    convertText(char *name);
         
-        void    convertImage(char *name, Image *img, int land);
+        Obj     *findImage(const char *key, const char *fname = 0,
+                           int *w = 0, int *h = 0);
+
+        Obj     *addImage(Image *img, const char *key = 0);
+
+        Obj     *textImage(char *name, int *w, int *h);
+
+        Obj     *findFile(off_t size, int mode,
+                          const unsigned char *md5 = 0, int *gunzip = 0);
+
+        void    addFile(off_t size, int mode, const unsigned char *md5,
+                        Obj *obj, int gunzip = 0);
+
+        void    convertImage(char *name, Obj *img, int land);
 };
 
 
@@ -0,0 +1,160 @@
+//
+//
+// Copyright 2019 Richard P. Cornwell All Rights Reserved,
+//
+// The software is provided "as is", without warranty of any kind, express
+// or implied, including but not limited to the warranties of
+// merchantability, fitness for a particular purpose and non-infringement.
+// In no event shall Richard Cornwell be liable for any claim, damages
+// or other liability, whether in an action of contract, tort or otherwise,
+// arising from, out of or in connection with the software or the use or other
+// dealings in the software.
+//
+// Permission to use, copy, and distribute this software and its
+// documentation for non commercial use is hereby granted,
+// provided that the above copyright notice appear in all copies and that
+// both that copyright notice and this permission notice appear in
+// supporting documentation.
+//
+// The sale, resale, or use of this program for profit without the
+// express written consent of the author Richard Cornwell is forbidden.
+//
+// This program uses a XML control file to generate a PDF file. This is used
+// to convert listings and images into a more easy to read format. This program
+// is also capable of doing limited black and white processing to scanned images
+// to make them easier to read.
+
+// SHA-256 message digest, as given in FIPS 180-4.
+
+#include <string.h>
+#include "SHA256.h"
+
+#define ROR(x, n)       (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)     (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)    (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x)           (ROR((x), 2) ^ ROR((x), 13) ^ ROR((x), 22))
+#define S1(x)           (ROR((x), 6) ^ ROR((x), 11) ^ ROR((x), 25))
+#define s0(x)           (ROR((x), 7) ^ ROR((x), 18) ^ ((x) >> 3))
+#define s1(x)           (ROR((x), 17) ^ ROR((x), 19) ^ ((x) >> 10))
+
+static const uint32_t k256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+void
+SHA256::reset()
+{
+    state[0] = 0x6a09e667;
+    state[1] = 0xbb67ae85;
+    state[2] = 0x3c6ef372;
+    state[3] = 0xa54ff53a;
+    state[4] = 0x510e527f;
+    state[5] = 0x9b05688c;
+    state[6] = 0x1f83d9ab;
+    state[7] = 0x5be0cd19;
+    count = 0;
+}
+
+// Hash one 64 byte block.
+void
+SHA256::block(const unsigned char *p)
+{
+    uint32_t        w[64];
+    uint32_t        a, b, c, d, e, f, g, h, t1, t2;
+    int             i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t)p[i*4] << 24) | (p[i*4+1] << 16) |
+               (p[i*4+2] << 8) | p[i*4+3];
+    for (; i < 64; i++)
+        w[i] = s1(w[i-2]) + w[i-7] + s0(w[i-15]) + w[i-16];
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + S1(e) + CH(e, f, g) + k256[i] + w[i];
+        t2 = S0(a) + MAJ(a, b, c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// Add data to the digest.
+void
+SHA256::update(const void *data, unsigned long n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned int    have = count & 63;
+    unsigned int    k;
+
+    count += n;
+    if (have != 0) {
+        k = 64 - have;
+        if (k > n)
+            k = n;
+        memcpy(&buf[have], p, k);
+        p += k;
+        n -= k;
+        if (have + k < 64)
+            return;
+        block(buf);
+    }
+    for (; n >= 64; n -= 64, p += 64)
+        block(p);
+    memcpy(buf, p, n);
+}
+
+// Finish the digest, pad out the last block with the length in bits.
+void
+SHA256::final(unsigned char digest[32])
+{
+    unsigned char   pad[72];
+    uint64_t        bits = count << 3;
+    unsigned int    n;
+    int             i;
+
+    n = 64 - (count & 63);
+    if (n < 9)
+        n += 64;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[n - 1 - i] = bits >> (8 * i);
+    update(pad, n);
+    for (i = 0; i < 32; i++)
+        digest[i] = state[i / 4] >> (24 - 8 * (i % 4));
+}
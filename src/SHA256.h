@@ -0,0 +1,50 @@
+//
+//
+// Copyright 2019 Richard P. Cornwell All Rights Reserved,
+//
+// The software is provided "as is", without warranty of any kind, express
+// or implied, including but not limited to the warranties of
+// merchantability, fitness for a particular purpose and non-infringement.
+// In no event shall Richard Cornwell be liable for any claim, damages
+// or other liability, whether in an action of contract, tort or otherwise,
+// arising from, out of or in connection with the software or the use or other
+// dealings in the software.
+//
+// Permission to use, copy, and distribute this software and its
+// documentation for non commercial use is hereby granted,
+// provided that the above copyright notice appear in all copies and that
+// both that copyright notice and this permission notice appear in
+// supporting documentation.
+//
+// The sale, resale, or use of this program for profit without the
+// express written consent of the author Richard Cornwell is forbidden.
+//
+// This program uses a XML control file to generate a PDF file. This is used
+// to convert listings and images into a more easy to read format. This program
+// is also capable of doing limited black and white processing to scanned images
+// to make them easier to read.
+
+// SHA-256 message digest (FIPS 180-4), put with the MD5 of embedded
+// files when asked for.
+
+#include <stdint.h>
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+class   SHA256 {
+        uint32_t        state[8];
+        uint64_t        count;          // Bytes hashed so far.
+        unsigned char   buf[64];        // Partial block.
+
+        void block(const unsigned char *p);
+public:
+        SHA256() { reset(); }
+
+        void reset();
+
+        void update(const void *data, unsigned long n);
+
+        void final(unsigned char digest[32]);
+};
+#endif
@@ -31,27 +31,58 @@
 #include <stdio.h>
 #include <zlib.h>
 #include "Obj.h"
+#include "Arena.h"
 
 #ifndef _STREAM_H_
 #define _STREAM_H_
+#define ZBUF_SIZE       65536
 class   Stream {
 public:
         Obj             *obj;
         unsigned int    size;
 private:
-        char            *extra;
+        const char      *extra;         // Filter data is already encoded in.
         char            *buffer;
         unsigned int    len;
         unsigned int    pos;
         int             opened;
+        int             packed;         // Data is joined into buffer.
+        int             flate;          // buffer is compressed.
+        unsigned int    csize;          // Size of data in buffer.
+        Arena           *arena;         // Where buffers come from, or 0.
+        z_stream        *zs;            // Compressing straight to file.
+        char            *zbuf;
+        Obj             *lobj;          // Length, put after the data.
         struct strmchnk {
              int                len;
              char               *value;
              struct strmchnk    *next;
         }    *list, *last;
 
+        char *get(unsigned int n) {
+           if (arena)
+               return (char *)arena->alloc(n);
+           return new char[n];
+        }
+
+        void drop(char *p) {
+           if (!arena)
+               delete[] p;
+        }
+
+        struct strmchnk *node() {
+           if (arena)
+               return (struct strmchnk *)arena->alloc(sizeof(struct strmchnk));
+           return new struct strmchnk;
+        }
+
+        void unnode(struct strmchnk *n) {
+           if (!arena)
+               delete n;
+        }
+
         void mkbuffer() {
-           buffer = new char[1024];
+           buffer = get(1024);
            len = 1024;
            pos = 0;
         }
@@ -59,7 +90,7 @@ private:
         void add() {
             struct strmchnk     *n;
 
-            n = new struct strmchnk;
+            n = node();
             if (last != 0) {
                 last->next = n;
             } else {
@@ -74,17 +105,19 @@ private:
         }
 
 public:
-        Stream(Obj *obj) : obj(obj), size(0), extra(0), buffer(0),
-                  len(0), pos(0), opened(0), list(0), last(0)
+        Stream(Obj *obj, Arena *arena = 0) : obj(obj), size(0), extra(0),
+                  buffer(0), len(0), pos(0), opened(0), packed(0), flate(0),
+                  csize(0), arena(arena), zs(0), zbuf(0), lobj(0),
+                  list(0), last(0)
                  { mkbuffer(); }
 
         ~Stream() {
                 struct strmchnk *l, *p;
-                delete[] buffer;
+                drop(buffer);
                 l = list;
                 while(l != NULL) {
                     p = l->next;
-                    delete l;
+                    unnode(l);
                     l = p;
                 }
         }
@@ -119,7 +152,7 @@ public:
                 if (pos != 0)
                     add();
 
-                n = new struct strmchnk;
+                n = node();
                 if (last != 0) {
                     last->next = n;
                 } else {
@@ -127,23 +160,27 @@ public:
                 }
                 n->len = sz;
                 n->next = 0;
-                n->value = new char[sz];
+                n->value = get(sz);
                 memcpy(n->value, data, sz);
                 size += sz;
                 last = n;
                 return;
              }
              while(sz > 0) {
-                while(pos < len && sz > 0) {
-                   buffer[pos++] = *data++;
-                   sz--;
-                }
+                unsigned int    n = len - pos;
+
+                if (n > sz)
+                    n = sz;
+                memcpy(&buffer[pos], data, n);
+                pos += n;
+                data += n;
+                sz -= n;
                 if (pos == len) {
                    add();
                 }
              }
         }
-        
+
         void appendCmd(const char *text) {
              appendData(text, strlen(text));
         }
@@ -187,27 +224,29 @@ public:
              opened = 1;
         }
 
-        void close() {
+        // Data has already been encoded with filter, so close will not
+        // compress it again.
+        void encoded(const char *filter) { extra = filter; }
+
+        // Join the data together and compress it. This does not touch the
+        // file, so it can be done away from the thread writing it.
+        void compress() {
             char                *p, *cbuffer;
             struct strmchnk     *s, *l;
             z_stream            strm;
 
             if (pos != 0)
                 add();
-            if (!opened)
-                open();
-            if (size == 0) {
-                obj->close();
+            if (size == 0 || packed)
                 return;
-            }
             if (list != 0 && list->next == 0) {
-                delete[] buffer;
+                drop(buffer);
                 buffer = list->value;
-                delete list;
+                unnode(list);
             } else {
                 if (size > len) {
-                    delete[] buffer;
-                    buffer = new char[size];
+                    drop(buffer);
+                    buffer = get(size);
                 }
                 p = buffer;
                 s = list;
@@ -215,16 +254,26 @@ public:
                     memcpy(p, s->value, s->len);
                     p += s->len;
                     l = s->next;
-                    delete[] s->value;
-                    delete s;
+                    drop(s->value);
+                    unnode(s);
                     s = l;
                 }
             }
             list = last = 0;
-            cbuffer = new char[size + (size/10) + 1];
+            packed = 1;
+            csize = size;
+            if (extra != 0)
+                return;
+            cbuffer = get(size + (size/10) + 1);
             memset(&strm, 0, sizeof(z_stream));
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
+            if (arena) {
+                strm.zalloc = Arena::zalloc;
+                strm.zfree = Arena::zfree;
+                strm.opaque = arena;
+            } else {
+                strm.zalloc = Z_NULL;
+                strm.zfree = Z_NULL;
+            }
             strm.next_in = (Bytef *)buffer;
             strm.avail_in = size;
             strm.total_in = 0;
@@ -235,22 +284,105 @@ public:
             deflateInit(&strm, Z_BEST_COMPRESSION);
             if (deflate(&strm, Z_FINISH) == Z_STREAM_END &&
                        strm.total_out < size) {
-               obj->put("/Filter/FlateDecode");
-               obj->put("Length", (int)strm.total_out);
-               obj->put(">>stream\n");
-               obj->putdata(cbuffer, strm.total_out);
-           } else {
-                obj->put("Length", (int)size);
-                obj->put(">>stream\n");
-                obj->putdata(buffer, size);
-           }
-            obj->put("endstream\nendobj\n");
+                drop(buffer);
+                buffer = cbuffer;
+                csize = strm.total_out;
+                flate = 1;
+            } else {
+                drop(cbuffer);
+            }
             deflateEnd(&strm);
-            delete[] cbuffer;
-            delete[] buffer;
+        }
+
+        void close() {
+            compress();
+            if (!opened)
+                open();
+            if (size == 0) {
+                obj->close();
+                return;
+            }
+            if (extra != 0)
+                obj->put(extra);
+            else if (flate)
+                obj->put("/Filter/FlateDecode");
+            obj->put("Length", (int)csize);
+            obj->put(">>stream\n");
+            obj->putdata(buffer, csize);
+            obj->put("endstream\nendobj\n");
+            drop(buffer);
             buffer = 0;
         }
 
+        // Write data already encoded with filter straight to the file as
+        // it is given. This is for data too big to hold, the length is put
+        // in an object of its own after the stream.
+        void putOpen(const char *filter) {
+            if (!opened)
+                open();
+            lobj = obj->newObj();
+            obj->put(filter);
+            lobj->ref("Length");
+            obj->put(">>stream\n");
+            csize = 0;
+        }
+
+        void putData(const char *data, unsigned int n) {
+            obj->putdata(data, n);
+            csize += n;
+        }
+
+        void putClose() {
+            obj->put("endstream\nendobj\n");
+            lobj->putNumber((int)csize);
+        }
+
+        // The same, compressing the data on the way.
+        void deflateOpen() {
+            putOpen("/Filter/FlateDecode");
+            zs = new z_stream;
+            memset(zs, 0, sizeof(z_stream));
+            zs->zalloc = Z_NULL;
+            zs->zfree = Z_NULL;
+            zs->data_type = Z_BINARY;
+            deflateInit(zs, Z_BEST_COMPRESSION);
+            zbuf = new char[ZBUF_SIZE];
+        }
+
+        void deflateData(const char *data, unsigned int n) {
+            zs->next_in = (Bytef *)data;
+            zs->avail_in = n;
+            do {
+                zs->next_out = (Bytef *)zbuf;
+                zs->avail_out = ZBUF_SIZE;
+                deflate(zs, Z_NO_FLUSH);
+                putData(zbuf, ZBUF_SIZE - zs->avail_out);
+            } while (zs->avail_out == 0);
+            size += n;
+        }
+
+        void deflateClose() {
+            int         r;
+
+            do {
+                zs->next_out = (Bytef *)zbuf;
+                zs->avail_out = ZBUF_SIZE;
+                r = deflate(zs, Z_FINISH);
+                putData(zbuf, ZBUF_SIZE - zs->avail_out);
+            } while (r == Z_OK);
+            putClose();
+            deflateEnd(zs);
+            delete zs;
+            delete[] zbuf;
+            zs = 0;
+            zbuf = 0;
+        }
+
+        // The data as it will be written, once compress has been called.
+        const char *packedData() { return buffer; }
+
+        unsigned int packedSize() { return csize; }
+
         void ref(const char *title = NULL) { obj->ref(title); }
 
         void put(const char *str) { obj->put(str); }
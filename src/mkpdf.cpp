@@ -26,6 +26,7 @@
 //
  
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <png.h>
 #include <sys/stat.h>
@@ -46,6 +47,9 @@ int         verbose = 0;            // Verbose flag
 int         landscape = 0;          // Are we portrat or landscape mode
 char        *in_section = 0;        // Inside a section, no section allowed.
 const char  *in_node = 0;           // Inside file node.
+int         max_dpi = 0;            // Reduce images above this resolution.
+char        *cache_dir = 0;         // Where processed images are kept.
+int         sha256 = 0;             // Put SHA-256 of attachments as well.
 
 
 void parseDoc(char *docname);
@@ -96,7 +100,7 @@ char PDFfileDTD[] =
       "<!ATTLIST listing name CDATA #REQUIRED"
                  " linesperpage CDATA \"55\">"
       "<!ELEMENT image (#PCDATA|threshold|avg|contrast|unsharp|label|portrat|landscape|"
-          "cw|ccw|rotate|flip|reverse|transpose|edgefill)*>"
+          "cw|ccw|rotate|flip|reverse|transpose|edgefill|normalize|downsample)*>"
       "<!ATTLIST image name CDATA #REQUIRED>"
       "<!ELEMENT contrast (#PCDATA)*>"
       "<!ATTLIST contrast angle CDATA #IMPLIED bright CDATA #IMPLIED>"
@@ -109,6 +113,9 @@ char PDFfileDTD[] =
       "<!ELEMENT avg (#PCDATA)*>"
       "<!ATTLIST avg offset CDATA #IMPLIED>"
       "<!ELEMENT edgefill (#PCDATA)*>"
+      "<!ELEMENT normalize (#PCDATA)*>"
+      "<!ELEMENT downsample (#PCDATA)*>"
+      "<!ATTLIST downsample dpi CDATA #IMPLIED>"
       "<!ELEMENT cw (#PCDATA)*>"
       "<!ELEMENT ccw (#PCDATA)*>"
       "<!ELEMENT rotate (#PCDATA)*>"
@@ -120,16 +127,51 @@ char PDFfileDTD[] =
 // Main program.
 //
 // Accepts a option of -v to display progress. And the name of a XML control file.
+// --max-dpi n reduces all images to at most n dots per inch.
+// --cache dir keeps processed images in dir, to be used by later runs.
+// --sha256 adds the SHA-256 of each attachment to its MD5 checksum.
 //
 int
 main(int argc, char *argv[])
 {
     char    *p;
+    char    *e;
+    long    n;
 
     while(--argc > 0) {
         p = *++argv;
         if (*p == '-' && p[1] == 'v') {
             verbose = 1;
+        } else if (strcmp(p, "--max-dpi") == 0 ||
+                   strncmp(p, "--max-dpi=", 10) == 0) {
+            if (p[9] == '=')
+                p = &p[10];
+            else if (argc > 1) {
+                argc--;
+                p = *++argv;
+            } else
+                p = 0;
+            n = (p != 0) ? strtol(p, &e, 10) : 0;
+            if (p == 0 || *p == '\0' || *e != '\0' || n <= 0 || n > 100000) {
+                fprintf(stderr, "--max-dpi needs a number from 1 to 100000\n");
+                exit(1);
+            }
+            max_dpi = n;
+        } else if (strcmp(p, "--cache") == 0 ||
+                   strncmp(p, "--cache=", 8) == 0) {
+            if (p[7] == '=')
+                cache_dir = &p[8];
+            else if (argc > 1) {
+                argc--;
+                cache_dir = *++argv;
+            }
+            if (cache_dir == 0 || *cache_dir == '\0') {
+                fprintf(stderr, "--cache needs a directory\n");
+                exit(1);
+            }
+            mkdir(cache_dir, 0777);
+        } else if (strcmp(p, "--sha256") == 0) {
+            sha256 = 1;
         } else {
             parseDoc(p);
         }
@@ -318,13 +360,16 @@ parseAttach(PDFfile *file, xmlDoc *doc, xmlNodePtr cur)
     }
     type = xmlNodeListGetString(doc, cur->xmlChildrenNode, 1);
     a->load(file, (char *)name, (type)?((char *)type):"file", mode);
-    xmlFree(name);
     if (type)
         xmlFree(type);
     if (id) {
         a->setid((char *)id);
         xmlFree(id);
+    } else {
+        fprintf(stderr, "Attachment %s has no id, it can't be placed\n",
+                        name);
     }
+    xmlFree(name);
 }
 
 //
@@ -559,20 +604,61 @@ parseImage(PDFfile *file, xmlDoc *doc, xmlNodePtr cur)
     xmlChar             *name;
     int                 land = 0;
     int                 label = 0;
+    int                 xform = 0;
     Image               *img;
+    Obj                 *img_obj;
+    xmlNodePtr          node;
+    xmlBufferPtr        key;
 
     name = xmlGetProp(cur, (const xmlChar *)"name");
     if (name == NULL) {
         fprintf(stderr, "Text tag missing name attribute\n");
         return;
     }
+    for (node = cur->xmlChildrenNode; node != NULL; node = node->next) {
+        if (node->type != XML_ELEMENT_NODE)
+            continue;
+        if (xmlStrcmp(node->name, (const xmlChar *)"label") == 0) 
+            label = 1;
+        else if (xmlStrcmp(node->name, (const xmlChar *)"portrat") == 0) 
+            land = 0;
+        else if (xmlStrcmp(node->name, (const xmlChar *)"landscape") == 0) 
+            land = 1;
+    }
+    // The same image with the same operations was already done.
+    key = xmlBufferCreate();
+    xmlNodeDump(key, doc, cur, 0, 0);
+    img_obj = file->findImage((const char *)xmlBufferContent(key),
+                              (const char *)name);
+    if (img_obj != 0) {
+        file->convertImage((label)?(char *)name:0, img_obj, land);
+        xmlBufferFree(key);
+        xmlFree(name);
+        return;
+    }
+    // Images with nothing to do are copied without decoding them, unless
+    // they have to be made smaller.
+    for (node = cur->xmlChildrenNode; node != NULL; node = node->next) {
+        if (node->type == XML_ELEMENT_NODE &&
+                xmlStrcmp(node->name, (const xmlChar *)"label") != 0 &&
+                xmlStrcmp(node->name, (const xmlChar *)"portrat") != 0 &&
+                xmlStrcmp(node->name, (const xmlChar *)"landscape") != 0)
+            break;
+    }
     img = new Image();
-    if (!img->open(name)) {
+    if (!((node == NULL) ? img->load(name, max_dpi) : img->open(name))) {
         fprintf(stderr, "Could not open image %s\n", name);
         xmlFree(name);
+        xmlBufferFree(key);
         delete img;
         return;
     }
+    if (max_dpi != 0)
+        img->downsample(max_dpi);
+    // Geometric operations are gathered into one transform and done in a
+    // single pass. Operations on single pixels don't care about
+    // orientation, so the transform waits for one that looks at the pixels
+    // around it (unsharp, downsample or edgefill), or the end.
     cur = cur->xmlChildrenNode;
     while (cur != NULL) {
         if (cur->type == XML_ELEMENT_NODE) {
@@ -597,6 +683,8 @@ parseImage(PDFfile *file, xmlDoc *doc, xmlNodePtr cur)
             } else if (xmlStrcmp(cur->name, (const xmlChar *)"contrast") == 0) {
                 parseContrast(file, doc, cur, img);
             } else if (xmlStrcmp(cur->name, (const xmlChar *)"unsharp") == 0) {
+                img->remap(xform);
+                xform = 0;
                 parseUnsharp(file, doc, cur, img);
             } 
             else if (xmlStrcmp(cur->name, (const xmlChar *)"label") == 0) 
@@ -606,25 +694,43 @@ parseImage(PDFfile *file, xmlDoc *doc, xmlNodePtr cur)
             else if (xmlStrcmp(cur->name, (const xmlChar *)"landscape") == 0) 
                 land = 1;
             else if (xmlStrcmp(cur->name, (const xmlChar *)"cw") == 0) 
-                img->rotater90();
+                xform = Image::compose(xform, XF_CW);
             else if (xmlStrcmp(cur->name, (const xmlChar *)"ccw") == 0) 
-                img->rotatel90();
+                xform = Image::compose(xform, XF_CCW);
             else if (xmlStrcmp(cur->name, (const xmlChar *)"rotate") == 0) 
-                img->rotate180();
+                xform = Image::compose(xform, XF_ROTATE);
             else if (xmlStrcmp(cur->name, (const xmlChar *)"flip") == 0) 
-                img->flip();
+                xform = Image::compose(xform, XF_FLIP);
             else if (xmlStrcmp(cur->name, (const xmlChar *)"reverse") == 0) 
-                img->reverse();
+                xform = Image::compose(xform, XF_REVERSE);
             else if (xmlStrcmp(cur->name, (const xmlChar *)"transpose") == 0) 
-                img->transpose();
-            else if (xmlStrcmp(cur->name, (const xmlChar *)"edgefill") == 0) 
+                xform = Image::compose(xform, XF_TRANSPOSE);
+            else if (xmlStrcmp(cur->name, (const xmlChar *)"normalize") == 0) 
+                img->normalize();
+            else if (xmlStrcmp(cur->name, (const xmlChar *)"downsample") == 0) {
+                int dpi = 150;
+                xmlChar *num;
+                num = xmlGetProp(cur, (const xmlChar *)"dpi");
+                if (num != NULL) {
+                    dpi = atoi((char *)num);
+                    xmlFree(num);
+                }
+                img->remap(xform);
+                xform = 0;
+                img->downsample(dpi);
+            } else if (xmlStrcmp(cur->name, (const xmlChar *)"edgefill") == 0) {
+                img->remap(xform);
+                xform = 0;
                 img->boardFill();
-            else 
+            } else 
                 fprintf(stderr, "tag listing: Unknown type %s\n", cur->name);
         }
         cur = cur->next;
     }
-    file->convertImage((label)?(char *)name:0, img, land);
+    img->remap(xform);
+    img_obj = file->addImage(img, (const char *)xmlBufferContent(key));
+    file->convertImage((label)?(char *)name:0, img_obj, land);
+    xmlBufferFree(key);
     delete img;
     xmlFree(name);
 }